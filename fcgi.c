@@ -0,0 +1,252 @@
+#include "mpaycomet.h"
+#include <sys/types.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <kcgi.h>
+#include <libgen.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <stdio.h>
+
+#define COPYRIGHT_LINE \
+    "Bug reports, feature requests to gemini|https://harkadev.com/oss" "\n" \
+    "Copyright (c) 2022 Harkaitz Agirre, harkaitz.aguirre@gmail.com" "\n" \
+    ""
+
+static const char help[] =
+    "Usage: kfcgi -p / -n NUM -- %s"                                                  "\n"
+    ""                                                                                "\n"
+    "FastCGI worker creating PAYCOMET forms. Each worker keeps a handle with"         "\n"
+    "the connection to PAYCOMET open between requests. Environment variables"         "\n"
+    "are the same as in mpaycomet, plus:"                                             "\n"
+    ""                                                                                "\n"
+    "    PAYCOMET_KEEPALIVE    : Seconds between keep-alive heartbeats (default 30)." "\n"
+    ""                                                                                "\n"
+    "    /form-auth?OPTS... : Create a payment form and redirect to it."              "\n"
+    "    /form-subs?OPTS... : Create a subscription form and redirect to it."         "\n"
+    "    /status?order=ID   : Get status: correct,failed,unfinished,refunded"         "\n"
+    ""                                                                                "\n"
+    "The options are those of `mpaycomet form-auth`: amount, order, language,"        "\n"
+    "description, originalIp, url_success, url_cancel, periodicity..."                "\n"
+    "Anyone reaching the worker can create forms for any amount, let only"            "\n"
+    "the web tier reach it."                                                          "\n"
+    ""                                                                                "\n"
+    COPYRIGHT_LINE
+    ;
+
+enum page {
+    PAGE_FORM_AUTH,
+    PAGE_FORM_SUBS,
+    PAGE_STATUS,
+    PAGE__MAX
+};
+
+static const char *const pages[PAGE__MAX] = {
+    [PAGE_FORM_AUTH] = "form-auth",
+    [PAGE_FORM_SUBS] = "form-subs",
+    [PAGE_STATUS]    = "status"
+};
+
+/* Options passed to mpay_form_prepare(). */
+enum key {
+    KEY_AMOUNT,
+    KEY_ORDER,
+    KEY_LANGUAGE,
+    KEY_DESCRIPTION,
+    KEY_MERCHANT_DESCRIPTION,
+    KEY_ID_USER,
+    KEY_TOKEN_USER,
+    KEY_ORIGINAL_IP,
+    KEY_SCORING,
+    KEY_SECURE,
+    KEY_USER_INTERACTION,
+    KEY_URL_SUCCESS,
+    KEY_URL_CANCEL,
+    KEY_PERIODICITY,
+    KEY_DATE_START,
+    KEY_DATE_END,
+    KEY__MAX
+};
+
+static const struct kvalid keys[KEY__MAX] = {
+    [KEY_AMOUNT]               = {kvalid_stringne, "amount"},
+    [KEY_ORDER]                = {kvalid_stringne, "order"},
+    [KEY_LANGUAGE]             = {kvalid_stringne, "language"},
+    [KEY_DESCRIPTION]          = {kvalid_stringne, "description"},
+    [KEY_MERCHANT_DESCRIPTION] = {kvalid_stringne, "merchantDescription"},
+    [KEY_ID_USER]              = {kvalid_stringne, "idUser"},
+    [KEY_TOKEN_USER]           = {kvalid_stringne, "tokenUser"},
+    [KEY_ORIGINAL_IP]          = {kvalid_stringne, "originalIp"},
+    [KEY_SCORING]              = {kvalid_stringne, "scoring"},
+    [KEY_SECURE]               = {kvalid_stringne, "secure"},
+    [KEY_USER_INTERACTION]     = {kvalid_stringne, "userInteraction"},
+    [KEY_URL_SUCCESS]          = {kvalid_stringne, "url_success"},
+    [KEY_URL_CANCEL]           = {kvalid_stringne, "url_cancel"},
+    [KEY_PERIODICITY]          = {kvalid_stringne, "periodicity"},
+    [KEY_DATE_START]           = {kvalid_stringne, "date_start"},
+    [KEY_DATE_END]             = {kvalid_stringne, "date_end"}
+};
+
+static void fcgi_reply(struct kreq *_r, enum khttp _code, const char *_location, const char *_text) {
+    khttp_head(_r, kresps[KRESP_STATUS], "%s", khttps[_code]);
+    khttp_head(_r, kresps[KRESP_CONTENT_TYPE], "%s", kmimetypes[KMIME_TEXT_PLAIN]);
+    khttp_head(_r, kresps[KRESP_CACHE_CONTROL], "%s", "no-store");
+    if (_location) {
+        khttp_head(_r, kresps[KRESP_LOCATION], "%s", _location);
+    }
+    khttp_body(_r);
+    khttp_puts(_r, _text);
+    khttp_puts(_r, "\n");
+}
+
+static void fcgi_failed(mpay *_mpay, struct kreq *_r) {
+    enum mpay_error e = mpay_last_error(_mpay);
+    if (e == MPAY_ERROR_SHED || e == MPAY_ERROR_LIMIT) {
+        fcgi_reply(_r, KHTTP_503, NULL, "Busy, try again.");
+    } else {
+        fcgi_reply(_r, KHTTP_502, NULL, "PAYCOMET failed.");
+    }
+}
+
+static void fcgi_form(mpay *_mpay, struct kreq *_r, enum mpay_operationType _type) {
+    char             *opts[KEY__MAX*2+1] = {0};
+    struct mpay_form  form               = {0};
+    char             *url                = NULL;
+    int               n                  = 0;
+    int               e;
+    if (!_r->fieldmap[KEY_AMOUNT] || !_r->fieldmap[KEY_ORDER]/*err*/) {
+        fcgi_reply(_r, KHTTP_400, NULL, "Missing parameter: amount, order.");
+        return;
+    }
+    for (int k=0; k<KEY__MAX; k++) {
+        if (_r->fieldmap[k]) {
+            opts[n++] = (char *)keys[k].name;
+            opts[n++] = _r->fieldmap[k]->val;
+        }
+    }
+    e = mpay_form_prepare(&form, _type, opts);
+    if (!e/*err*/) goto cleanup_invalid_args;
+    e = mpay_form(_mpay, &form, &url);
+    if (!e/*err*/) goto cleanup_failed;
+    fcgi_reply(_r, KHTTP_302, url, url);
+    free(url);
+    return;
+ cleanup_invalid_args:
+    fcgi_reply(_r, KHTTP_400, NULL, "Invalid arguments.");
+    return;
+ cleanup_failed:
+    fcgi_failed(_mpay, _r);
+}
+
+static void fcgi_status(mpay *_mpay, struct kreq *_r) {
+    enum mpay_payment_state state;
+    int                     e;
+    if (!_r->fieldmap[KEY_ORDER]/*err*/) {
+        fcgi_reply(_r, KHTTP_400, NULL, "Missing parameter: order.");
+        return;
+    }
+    e = mpay_payment_info(_mpay, _r->fieldmap[KEY_ORDER]->val, &state, NULL, NULL);
+    if (!e/*err*/) {
+        fcgi_failed(_mpay, _r);
+        return;
+    }
+    switch(state) {
+    case MPAY_PAYMENT_FAILED:     fcgi_reply(_r, KHTTP_200, NULL, "failed");     break;
+    case MPAY_PAYMENT_CORRECT:    fcgi_reply(_r, KHTTP_200, NULL, "correct");    break;
+    case MPAY_PAYMENT_UNFINISHED: fcgi_reply(_r, KHTTP_200, NULL, "unfinished"); break;
+    case MPAY_PAYMENT_REFUNDED:   fcgi_reply(_r, KHTTP_200, NULL, "refunded");   break;
+    }
+}
+
+int main(int _argc, char *_argv[]) {
+
+    int            ret   = 1;
+    struct kfcgi  *fcgi  = NULL;
+    mpay          *mpay  = NULL;
+    char          *pname = basename(_argv[0]);
+    struct kreq    r;
+    enum kcgi_err  er;
+    const char    *s;
+    int            e;
+
+    /* Print help. */
+    if (_argc > 1 || !khttp_fcgi_test()) {
+        printf(help, pname);
+        return (_argc > 1)?0:1;
+    }
+
+    /* Initialize logging, the standard error may be closed. */
+    openlog(pname, LOG_PID, LOG_USER);
+
+    /* Start the FastCGI worker, it forks the request parser. */
+    er = khttp_fcgi_init(&fcgi, keys, KEY__MAX, pages, PAGE__MAX, PAGE_STATUS);
+    if (er != KCGI_OK/*err*/) goto cleanup_kcgi;
+
+    /* Initialize paycomet, after the fork so that its threads stay here.
+     * Workers always pre-warm and keep the connection alive. */
+    e = mpay_create_env(&mpay);
+    if (!e/*err*/) goto cleanup;
+    e = mpay_chk_auth(mpay, &s);
+    if (!e/*err*/) { syslog(LOG_ERR, "%s", s); goto cleanup; }
+    mpay_set_priority(mpay, MPAY_PRIORITY_INTERACTIVE);
+    if (!getenv("PAYCOMET_PREWARM")) {
+        e = mpay_prewarm(mpay);
+        if (!e/*err*/) goto cleanup;
+    }
+    if (!getenv("PAYCOMET_KEEPALIVE")) {
+        e = mpay_keepalive(mpay, 30);
+        if (!e/*err*/) goto cleanup;
+    }
+
+    /* Serve requests until the manager stops the worker. */
+    while ((er = khttp_fcgi_parse(fcgi, &r)) == KCGI_OK) {
+        switch (r.page) {
+        case PAGE_FORM_AUTH: fcgi_form(mpay, &r, MPAY_FORM_AUTHORIZATION); break;
+        case PAGE_FORM_SUBS: fcgi_form(mpay, &r, MPAY_FORM_SUBSCRIPTION);  break;
+        case PAGE_STATUS:    fcgi_status(mpay, &r);                        break;
+        default:             fcgi_reply(&r, KHTTP_404, NULL, "Not found."); break;
+        }
+        khttp_free(&r);
+        mpay_trace_flush();
+    }
+    if (er != KCGI_EXIT/*err*/) goto cleanup_kcgi;
+    ret = 0;
+    goto cleanup;
+
+    /* Cleanup. */
+ cleanup_kcgi:
+    syslog(LOG_ERR, "FastCGI: %s", kcgi_strerror(er));
+    goto cleanup;
+ cleanup:
+    if (mpay) mpay_destroy(mpay);
+    if (fcgi) khttp_fcgi_free(fcgi);
+    mpay_trace_stop();
+    return ret;
+}
+/**l*
+ * 
+ * MIT License
+ * 
+ * Bug reports, feature requests to gemini|https://harkadev.com/oss
+ * Copyright (c) 2022 Harkaitz Agirre, harkaitz.aguirre@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ **l*/
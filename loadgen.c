@@ -0,0 +1,454 @@
+#include "mpaycomet.h"
+#include <libgen.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <jansson.h>
+
+#define COPYRIGHT_LINE \
+    "Bug reports, feature requests to gemini|https://harkadev.com/oss" "\n" \
+    "Copyright (c) 2022 Harkaitz Agirre, harkaitz.aguirre@gmail.com" "\n" \
+    ""
+
+static const char help[] =
+    "Usage: %s [-c NUM][-r RATE][-d SECS][-n NUM][-m MIX][-A MIN,MAX]..."             "\n"
+    ""                                                                                "\n"
+    "Send PAYCOMET requests through libmpaycomet and report the throughput,"          "\n"
+    "the latency percentiles and the errors. Environment variables are the"           "\n"
+    "same as in mpaycomet, set PAYCOMET_URL to test a local server."                  "\n"
+    ""                                                                                "\n"
+    "    -c NUM    : Requests in flight (default 10, 1000 with -r)."                  "\n"
+    "    -r RATE   : Start RATE requests per second (default as fast as -c)."         "\n"
+    "    -d SECS   : Duration (default 10)."                                          "\n"
+    "    -n NUM    : Stop after NUM requests."                                        "\n"
+    "    -m MIX    : Operations and weights (default heartbeat=1)."                   "\n"
+    "    -o ORDER  : Order for form-auth, payment-status and payment-refund."         "\n"
+    "    -a AMOUNT : Amount for form-auth, exchange and payment-refund (1eur)."       "\n"
+    "    -x CURR   : Currency to exchange to (default usd)."                          "\n"
+    "    -b        : Send as background priority."                                    "\n"
+    "    -A MIN,MAX: Adapt the requests in flight to the latency (see -W)."           "\n"
+    "    -W MS     : Wait MS for a slot over the adaptive limit (default 0)."         "\n"
+    ""                                                                                "\n"
+    "Operations: heartbeat, form-auth, payment-status, exchange and"                  "\n"
+    "payment-refund (payment info followed by the refund)."                           "\n"
+    ""                                                                                "\n"
+    "With -r latency is measured from the time a request should have been"            "\n"
+    "started, so that requests delayed by a full -c count as slow. They are"          "\n"
+    "reported as \"delayed by -c\", raise -c when there are any."                     "\n"
+    ""                                                                                "\n"
+    "With -A requests over the limit fail at once (or after -W) and are"              "\n"
+    "reported as \"limited\", the scheduler statistics are printed at exit."          "\n"
+    ""                                                                                "\n"
+    COPYRIGHT_LINE
+    ;
+
+/* ---- Latency histogram. ----
+ *
+ * Log-linear buckets as in HdrHistogram: every power of two is split
+ * in 1024 steps, so any value is kept with three significant digits
+ * from 1 microsecond to hours in a fixed amount of memory. */
+
+#define HIST_BITS 11
+#define HIST_SUB  (1<<HIST_BITS)
+#define HIST_MAG  26
+
+struct hist {
+    unsigned long count;
+    unsigned long max;
+    unsigned int  c[HIST_MAG][HIST_SUB];
+};
+
+static void hist_add(struct hist *_h, unsigned long _us) {
+    int b = 0;
+    if (_us > _h->max) _h->max = _us;
+    while ((_us >> b) >= HIST_SUB) b++;
+    if (b >= HIST_MAG) {
+        b   = HIST_MAG-1;
+        _us = ((unsigned long)HIST_SUB << b)-1;
+    }
+    _h->c[b][_us >> b]++;
+    _h->count++;
+}
+
+static unsigned long hist_percentile(struct hist *_h, double _p) {
+    unsigned long want = _h->count*_p/100.0+0.5, seen = 0;
+    if (want < 1) want = 1;
+    for (int b=0; b<HIST_MAG; b++) {
+        for (int s=(b)?HIST_SUB/2:0; s<HIST_SUB; s++) {
+            seen += _h->c[b][s];
+            if (seen >= want) {
+                unsigned long v = (((unsigned long)s+1) << b)-1;
+                return (v < _h->max)?v:_h->max;
+            }
+        }
+    }
+    return _h->max;
+}
+
+/* ---- Operations. ---- */
+
+enum lg_kind {
+    LG_HEARTBEAT = 0,
+    LG_FORM_AUTH,
+    LG_PAYMENT_STATUS,
+    LG_EXCHANGE,
+    LG_PAYMENT_REFUND,
+    LG_KINDS
+};
+
+static const char *lg_names[LG_KINDS] = {
+    "heartbeat", "form-auth", "payment-status", "exchange", "payment-refund"
+};
+
+struct lg_stat {
+    struct hist   *hist;
+    unsigned long  errors;
+};
+
+struct lg_req {
+    enum lg_kind     kind;
+    struct timespec  t0;
+    bool             info_done; /* payment-refund: refund step. */
+};
+
+struct lg {
+    mpay             *mpay;
+    int               weights[LG_KINDS];
+    int               weights_total;
+    const char       *order;
+    coin_t            amount;
+    const char       *currency;
+    struct mpay_form  form;
+    struct lg_stat    stat[LG_KINDS];
+    struct hist      *total;
+    unsigned long     errors_start;     /* Could not be started. */
+    unsigned long     errors_transport; /* No response. */
+    unsigned long     errors_shed;      /* Dropped by the scheduler. */
+    unsigned long     errors_limit;     /* Over the adaptive limit. */
+    unsigned long     errors_invalid;   /* Invalid response. */
+    unsigned long     errors_http[600]; /* HTTP status. */
+    unsigned long     delayed;          /* Started late because of -c. */
+    int               inflight;
+};
+
+static long lg_usec(struct timespec *_a, struct timespec *_b) {
+    return (_b->tv_sec-_a->tv_sec)*1000000+(_b->tv_nsec-_a->tv_nsec)/1000;
+}
+
+static bool lg_parse_mix(struct lg *_lg, char *_mix) {
+    char *tok, *save = NULL, *eq;
+    for (tok = strtok_r(_mix, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        int k, w = 1;
+        if ((eq = strchr(tok, '='))) {
+            *eq = '\0';
+            w = atoi(eq+1);
+            if (w < 0/*err*/) goto cleanup_invalid;
+        }
+        for (k=0; k<LG_KINDS && strcmp(tok, lg_names[k]); k++) {}
+        if (k == LG_KINDS/*err*/) goto cleanup_invalid;
+        _lg->weights[k]     = w;
+        _lg->weights_total += w;
+    }
+    if (!_lg->weights_total/*err*/) goto cleanup_invalid;
+    return true;
+ cleanup_invalid:
+    syslog(LOG_ERR, "Invalid operation mix: %s", tok?tok:"");
+    return false;
+}
+
+static enum lg_kind lg_pick(struct lg *_lg) {
+    int r = rand() % _lg->weights_total;
+    for (int k=0; k<LG_KINDS; k++) {
+        if (r < _lg->weights[k]) return k;
+        r -= _lg->weights[k];
+    }
+    return LG_HEARTBEAT;
+}
+
+static bool lg_start(struct lg *_lg, struct lg_req *_r) {
+    mpay_op *op = NULL;
+    bool     e  = false;
+    switch (_r->kind) {
+    case LG_HEARTBEAT:
+        e = mpay_op_start_heartbeat(_lg->mpay, &op);
+        break;
+    case LG_FORM_AUTH:
+        e = mpay_op_start_form(_lg->mpay, &op, &_lg->form);
+        break;
+    case LG_PAYMENT_STATUS:
+    case LG_PAYMENT_REFUND:
+        e = mpay_op_start_payment_info(_lg->mpay, &op, _lg->order);
+        break;
+    case LG_EXCHANGE:
+        e = mpay_op_start_exchange(_lg->mpay, &op, _lg->amount, _lg->currency);
+        break;
+    case LG_KINDS:
+        break;
+    }
+    if (!e/*err*/) return false;
+    mpay_op_set_data(op, _r);
+    _lg->inflight++;
+    return true;
+}
+
+static void lg_end(struct lg *_lg, struct lg_req *_r, bool _ok, enum mpay_error _error, long _rcode) {
+    struct timespec t;
+    long            us;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    us = lg_usec(&_r->t0, &t);
+    if (us < 0) us = 0;
+    hist_add(_lg->stat[_r->kind].hist, us);
+    hist_add(_lg->total, us);
+    if (!_ok) {
+        _lg->stat[_r->kind].errors++;
+        if (_error == MPAY_ERROR_SHED) {
+            _lg->errors_shed++;
+        } else if (_error == MPAY_ERROR_LIMIT) {
+            _lg->errors_limit++;
+        } else if (!_rcode) {
+            _lg->errors_transport++;
+        } else if (_rcode >= 300 && _rcode < 600) {
+            _lg->errors_http[_rcode]++;
+        } else {
+            _lg->errors_invalid++;
+        }
+    }
+    free(_r);
+}
+
+static void lg_collect(struct lg *_lg) {
+    mpay_op       *op;
+    struct lg_req *r;
+    json_t        *info;
+    bool           ok;
+    while ((op = mpay_op_next(_lg->mpay))) {
+        r  = mpay_op_get_data(op);
+        ok = mpay_op_result(op, NULL);
+        _lg->inflight--;
+        if (ok && r->kind == LG_PAYMENT_REFUND && !r->info_done) {
+            /* Second step, refund what the info request returned. */
+            mpay_op  *op2 = NULL;
+            r->info_done = true;
+            info = NULL;
+            mpay_op_payment_info(op, NULL, &info, NULL);
+            ok = mpay_op_start_refund(_lg->mpay, &op2, _lg->order, info, _lg->amount);
+            if (info) json_decref(info);
+            if (ok) {
+                mpay_op_set_data(op2, r);
+                _lg->inflight++;
+                mpay_op_destroy(op);
+                continue;
+            }
+        }
+        lg_end(_lg, r, ok, mpay_op_error(op), mpay_op_rcode(op));
+        mpay_op_destroy(op);
+    }
+}
+
+static void lg_report(struct lg *_lg, FILE *_fp, double _secs) {
+    static const double  pcts[]  = {50, 90, 99, 99.9};
+    static const char   *pnames[] = {"p50", "p90", "p99", "p99.9"};
+    unsigned long        errors = _lg->errors_start+_lg->errors_transport+_lg->errors_shed+_lg->errors_limit+_lg->errors_invalid;
+    for (int i=0; i<600; i++) errors += _lg->errors_http[i];
+    fprintf(_fp, "Duration          : %.3f s\n", _secs);
+    fprintf(_fp, "Requests          : %lu (%.1f/s)\n", _lg->total->count,
+            (_secs > 0)?_lg->total->count/_secs:0.0);
+    fprintf(_fp, "Errors            : %lu\n", errors);
+    if (_lg->errors_start)     fprintf(_fp, "    not started   : %lu\n", _lg->errors_start);
+    if (_lg->errors_transport) fprintf(_fp, "    no response   : %lu\n", _lg->errors_transport);
+    if (_lg->errors_shed)      fprintf(_fp, "    shed          : %lu\n", _lg->errors_shed);
+    if (_lg->errors_limit)     fprintf(_fp, "    limited       : %lu\n", _lg->errors_limit);
+    if (_lg->errors_invalid)   fprintf(_fp, "    invalid reply : %lu\n", _lg->errors_invalid);
+    for (int i=0; i<600; i++) {
+        if (_lg->errors_http[i]) fprintf(_fp, "    HTTP %03i      : %lu\n", i, _lg->errors_http[i]);
+    }
+    if (_lg->delayed) fprintf(_fp, "Delayed by -c     : %lu\n", _lg->delayed);
+    fprintf(_fp, "\n%-16s %8s %8s", "OPERATION (ms)", "COUNT", "ERRORS");
+    for (int p=0; p<4; p++) fprintf(_fp, " %8s", pnames[p]);
+    fprintf(_fp, " %8s\n", "max");
+    for (int k=0; k<=LG_KINDS; k++) {
+        struct hist   *h   = (k<LG_KINDS)?_lg->stat[k].hist:_lg->total;
+        unsigned long  err = (k<LG_KINDS)?_lg->stat[k].errors:errors;
+        if (!h->count) continue;
+        fprintf(_fp, "%-16s %8lu %8lu", (k<LG_KINDS)?lg_names[k]:"total", h->count, err);
+        for (int p=0; p<4; p++) fprintf(_fp, " %8.3f", hist_percentile(h, pcts[p])/1000.0);
+        fprintf(_fp, " %8.3f\n", h->max/1000.0);
+    }
+}
+
+int main (int _argc, char *_argv[]) {
+    int             e, opt;
+    int             ret         = 1;
+    char           *pname       = basename(_argv[0]);
+    struct lg       lg          = {0};
+    int             concurrency = 0;
+    double          rate        = 0;
+    double          duration    = 10;
+    unsigned long   limit       = 0;
+    unsigned long   issued      = 0;
+    char           *mix         = NULL;
+    bool            background  = false;
+    int             limit_min   = 0;
+    int             limit_max   = 0;
+    int             limit_wait  = 0;
+    const char     *amount      = "1eur";
+    char           *form_opts[] = {"order", NULL, "amount", NULL, NULL};
+    struct timespec start, now, next, capped = {0};
+
+    /* Initialize logging. */
+    openlog(pname, LOG_PERROR, LOG_USER);
+
+    /* Parse command line arguments. */
+    lg.order    = "loadgen";
+    lg.currency = "usd";
+    while ((opt = getopt(_argc, _argv, "hc:r:d:n:m:o:a:x:bA:W:")) != -1) {
+        switch (opt) {
+        case 'c':
+            concurrency = atoi(optarg);
+            if (concurrency < 1/*err*/) goto cleanup_invalid_args;
+            break;
+        case 'r': rate        = atof(optarg);        break;
+        case 'd': duration    = atof(optarg);        break;
+        case 'n': limit       = strtoul(optarg, NULL, 10); break;
+        case 'm': mix         = optarg;              break;
+        case 'o': lg.order    = optarg;              break;
+        case 'a': amount      = optarg;              break;
+        case 'x': lg.currency = optarg;              break;
+        case 'b': background  = true;                break;
+        case 'A':
+            if (sscanf(optarg, "%i,%i", &limit_min, &limit_max) != 2/*err*/) goto cleanup_invalid_args;
+            break;
+        case 'W': limit_wait  = atoi(optarg);        break;
+        case 'h':
+            printf(help, pname);
+            return 0;
+        default:
+            return 1;
+        }
+    }
+
+    if (rate < 0 || duration < 0/*err*/) goto cleanup_invalid_args;
+    if (!concurrency) concurrency = (rate)?1000:10;
+    if (!limit && !duration/*err*/) goto cleanup_invalid_args;
+    if (limit_max && (limit_min < 1 || limit_max < limit_min || limit_wait < 0)/*err*/) goto cleanup_invalid_args;
+    e = lg_parse_mix(&lg, (mix)?mix:(char[]){"heartbeat"});
+    if (!e/*err*/) goto cleanup;
+    e = coin_parse(&lg.amount, amount, NULL);
+    if (!e/*err*/) goto cleanup_invalid_args;
+    form_opts[1] = (char *)lg.order;
+    form_opts[3] = (char *)amount;
+    e = mpay_form_prepare(&lg.form, MPAY_FORM_AUTHORIZATION, form_opts);
+    if (!e/*err*/) goto cleanup;
+
+    /* Histograms. */
+    lg.total = calloc(1, sizeof(struct hist));
+    if (!lg.total/*err*/) goto cleanup_errno;
+    for (int k=0; k<LG_KINDS; k++) {
+        lg.stat[k].hist = calloc(1, sizeof(struct hist));
+        if (!lg.stat[k].hist/*err*/) goto cleanup_errno;
+    }
+
+    /* Initialize paycomet. */
+    e = mpay_create_env(&lg.mpay);
+    if (!e/*err*/) goto cleanup;
+    e = mpay_chk_auth(lg.mpay, NULL);
+    if (!e/*err*/) goto cleanup;
+    if (background) mpay_set_priority(lg.mpay, MPAY_PRIORITY_BACKGROUND);
+    if (limit_max)  mpay_sched_adaptive(limit_min, limit_max, limit_wait);
+
+    /* Main loop: start requests while allowed, wait, collect. */
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    next = start;
+    for (;;) {
+        bool  stop;
+        long  wait_ms = 100;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        stop = (limit && issued >= limit) || (duration && lg_usec(&start, &now) >= duration*1e6);
+        if (stop && !lg.inflight) break;
+        while (!stop && lg.inflight < concurrency && (!rate || lg_usec(&next, &now) >= 0)) {
+            struct lg_req *r = calloc(1, sizeof(struct lg_req));
+            if (!r/*err*/) goto cleanup_errno;
+            r->kind = lg_pick(&lg);
+            r->t0   = (rate)?next:now;
+            if (rate && lg_usec(&next, &capped) >= 0) lg.delayed++;
+            if (!lg_start(&lg, r)/*err*/) {
+                lg.errors_start++;
+                free(r);
+            }
+            issued++;
+            if (rate) {
+                long ns = next.tv_nsec + (long)(1e9/rate);
+                next.tv_sec  += ns / 1000000000;
+                next.tv_nsec  = ns % 1000000000;
+            }
+            stop = (limit && issued >= limit);
+        }
+        if (rate && !stop && lg.inflight >= concurrency && lg_usec(&next, &now) >= 0) {
+            capped = now; /* The next request is due but -c is full. */
+        }
+        lg_collect(&lg);
+        if (rate && !stop && lg.inflight < concurrency) {
+            wait_ms = -lg_usec(&next, &now)/1000;
+            if (wait_ms < 0)   wait_ms = 0;
+            if (wait_ms > 100) wait_ms = 100;
+        }
+        if (lg.inflight) {
+            e = mpay_op_wait(lg.mpay, wait_ms, NULL);
+            if (!e/*err*/) goto cleanup;
+        } else if (wait_ms) {
+            usleep(wait_ms*1000);
+        }
+        lg_collect(&lg);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    lg_report(&lg, stdout, lg_usec(&start, &now)/1e6);
+    if (getenv("PAYCOMET_STATS")) mpay_print_stats(lg.mpay, stderr);
+    if (limit_max)                mpay_sched_print_stats(stderr);
+    ret = 0;
+    goto cleanup;
+
+    /* Cleanup. */
+ cleanup_invalid_args:
+    syslog(LOG_ERR, "Invalid arguments.");
+    goto cleanup;
+ cleanup_errno:
+    syslog(LOG_ERR, "%s", strerror(errno));
+    goto cleanup;
+ cleanup:
+    if (lg.mpay) mpay_destroy(lg.mpay);
+    for (int k=0; k<LG_KINDS; k++) free(lg.stat[k].hist);
+    free(lg.total);
+    mpay_trace_stop();
+    return ret;
+}
+/**l*
+ * 
+ * MIT License
+ * 
+ * Bug reports, feature requests to gemini|https://harkadev.com/oss
+ * Copyright (c) 2022 Harkaitz Agirre, harkaitz.aguirre@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ **l*/
@@ -5,11 +5,17 @@
 #include <stdint.h>
 #include <kcgi.h>
 #include <libgen.h>
+#include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
 #include <stdio.h>
 #include <jansson.h>
 
+#ifndef VARDIR
+#  define VARDIR "/var/lib"
+#endif
+#define MPAY_CACHE_DEFAULT VARDIR "/mpaycomet/cache"
+
 #define COPYRIGHT_LINE \
     "Bug reports, feature requests to gemini|https://harkadev.com/oss" "\n" \
     "Copyright (c) 2022 Harkaitz Agirre, harkaitz.aguirre@gmail.com" "\n" \
@@ -20,8 +26,21 @@ static const char help[] =
     ""                                                                                "\n"
     "Environment variables:"                                                          "\n"
     ""                                                                                "\n"
-    "    PAYCOMET_API_TOKEN : %s"                                                     "\n"
-    "    PAYCOMET_TERMINAL  : %s"                                                     "\n"
+    "    PAYCOMET_API_TOKEN    : %s"                                                  "\n"
+    "    PAYCOMET_TERMINAL     : %s"                                                  "\n"
+    "    PAYCOMET_URL          : Base URL (default https://rest.paycomet.com)."       "\n"
+    "    PAYCOMET_RECORD       : Record requests and responses to this file."         "\n"
+    "    PAYCOMET_REPLAY       : Replay responses from this file."                    "\n"
+    "    PAYCOMET_REPLAY_TIMED : Replay responses with the recorded latency."         "\n"
+    "    PAYCOMET_STATS        : When set print connection statistics at exit."       "\n"
+    "    PAYCOMET_CACHE        : DNS cache file (empty: " MPAY_CACHE_DEFAULT ")."       "\n"
+    "    PAYCOMET_COMPRESS     : Encodings to accept (default all, \"no\": none)."    "\n"
+    "    PAYCOMET_PREWARM      : When set connect in the background at start."        "\n"
+    "    PAYCOMET_KEEPALIVE    : Seconds between keep-alive heartbeats (default no)." "\n"
+    "    PAYCOMET_TRACE        : Write trace spans to this file (Chrome format)."     "\n"
+    "    PAYCOMET_TRACE_OTLP   : Write trace spans to this file (OTLP-JSON)."         "\n"
+    "    PAYCOMET_TRACE_SAMPLE : Fraction of calls traced (default 1, failed all)."   "\n"
+    "    PAYCOMET_TRACE_SLOW_MS: Also trace all calls slower than this."              "\n"
     ""                                                                                "\n"
     "Create payment forms using PAYCOMET."                                            "\n"
     ""                                                                                "\n"
@@ -29,9 +48,23 @@ static const char help[] =
     "    exchange MONETARY CURRENCY : Exchange currency."                             "\n"
     "    heartbeat                  : Check the connection is right."                 "\n"
     "    form-auth OPTS...          : Create a payment form and get URL."             "\n"
+    "    purchase OPTS...           : Charge a stored card, print state and URL."     "\n"
+    "    purchase-rtoken OPTS...    : Same, using the rtoken endpoint."               "\n"
     "    payment-info   ORDER-ID    : Get payment info of form."                      "\n"
     "    payment-status ORDER-ID    : Get status: correct,failed,unfinished,refunded" "\n"
     "    payment-refund ORDER-ID    : Refund payment."                                "\n"
+    "    refund-bulk JOURNAL [NUM]  : Refund \"ORDER [MONETARY]\" lines read from"    "\n"
+    "                                 stdin, NUM at a time (default 8)."              "\n"
+    ""                                                                                "\n"
+    "Charge stored cards periodically, scheduled in a local INDEX file."              "\n"
+    ""                                                                                "\n"
+    "    subs-add INDEX [OPTS...]   : Add a subscription (order=ID idUser tokenUser"  "\n"
+    "                                 amount periodicity date_start date_end), or"    "\n"
+    "                                 one per line of stdin without OPTS."            "\n"
+    "    subs-cancel INDEX ID       : Cancel a subscription."                         "\n"
+    "    subs-list INDEX            : Print ID STATE NEXT AMOUNT DAYS CHARGES FAILS." "\n"
+    "    subs-run INDEX IP [NUM [RATE]] : Charge the due subscriptions, NUM at a"     "\n"
+    "                                 time (default 8), RATE per second at most."     "\n"
     ""                                                                                "\n"
     "Form options:"                                                                   "\n"
     ""                                                                                "\n"
@@ -43,6 +76,10 @@ static const char help[] =
     "    url_success=URL_OK         : URL when success."                              "\n"
     "    url_cancel=URL_KO          : URL when cancelling."                           "\n"
     ""                                                                                "\n"
+    "    idUser=ID                  : Stored card id (purchase)."                     "\n"
+    "    tokenUser=TOKEN            : Stored card token (purchase)."                  "\n"
+    "    originalIp=IP              : Customer's IP address (purchase)."              "\n"
+    ""                                                                                "\n"
     "    date_start=YYYY/MM/DD      : Subscription start date (default today)"        "\n"
     "    date_end=YYYY/MM/DD        : Subscription end date (default 5 years)"        "\n"
     "    periodicity=NUM            : Payment periodicity in days. (default 30)"      "\n"
@@ -79,11 +116,8 @@ int main (int _argc, char *_argv[]) {
     openlog(pname, LOG_PERROR, LOG_USER);
 
     /* Initiaze paycomet. */
-    e = mpay_create(&mpay);
+    e = mpay_create_env(&mpay);
     if (!e/*err*/) goto cleanup;
-    mpay_set_auth(mpay,
-                  getenv("PAYCOMET_API_TOKEN"),
-                  getenv("PAYCOMET_TERMINAL"));
 
     /* Get command and arguments. */
     if (!strcmp(cmd, "methods-get")) {
@@ -128,6 +162,30 @@ int main (int _argc, char *_argv[]) {
         printf("%s\n", m1);
         free(m1);
 
+    } else if (!strcmp(cmd, "purchase") || !strcmp(cmd, "purchase-rtoken")) {
+
+        char                    *opts[100];
+        struct mpay_form         form = {0};
+        char                    *m1   = NULL;
+        enum mpay_payment_state  state;
+        streq2map(args, 100, opts);
+        e = mpay_form_prepare(&form, MPAY_FORM_AUTHORIZATION, opts);
+        if (!e/*err*/) goto cleanup;
+        if (!strcmp(cmd, "purchase")) {
+            e = mpay_execute_purchase(mpay, &form, &state, &m1, NULL);
+        } else {
+            e = mpay_execute_purchase_rtoken(mpay, &form, &state, &m1, NULL);
+        }
+        if (!e/*err*/) goto cleanup;
+        switch(state) {
+        case MPAY_PAYMENT_FAILED:     fputs("failed\n"    , stdout); break;
+        case MPAY_PAYMENT_CORRECT:    fputs("correct\n"   , stdout); break;
+        case MPAY_PAYMENT_UNFINISHED: fputs("unfinished\n", stdout); break;
+        case MPAY_PAYMENT_REFUNDED:   fputs("refunded\n"  , stdout); break;
+        }
+        if (m1) printf("%s\n", m1);
+        free(m1);
+
     } else if (!strcmp(cmd, "heartbeat")) {
 
         e = mpay_heartbeat(mpay, stdout);
@@ -169,6 +227,119 @@ int main (int _argc, char *_argv[]) {
         if (!e/*err*/) goto cleanup;
         json_dumpf(json2, stdout, JSON_INDENT(4));
 
+    } else if (!strcmp(cmd, "refund-bulk")) {
+
+        static const char  *names[] = {"pending", "done", "skipped", "failed", "unknown"};
+        struct mpay_refund *v       = NULL, *v2;
+        size_t              vsz     = 0;
+        char               *l       = NULL;
+        size_t              lsz     = 0;
+        char               *order,*amount,*save;
+        if (!arg1/*err*/) goto cleanup_invalid_args;
+        e = true;
+        while (e && getline(&l, &lsz, stdin) != -1) {
+            if (!(order = strtok_r(l, " \t\r\n", &save))) continue;
+            amount = strtok_r(NULL, " \t\r\n", &save);
+            e = (v2 = realloc(v, (vsz+1)*sizeof(struct mpay_refund))) != NULL;
+            if (!e/*err*/) break;
+            v = v2;
+            memset(&v[vsz], 0, sizeof(struct mpay_refund));
+            e = (v[vsz].order = strdup(order)) != NULL;
+            if (!e/*err*/) break;
+            vsz++;
+            if (amount && !coin_parse(&v[vsz-1].amount, amount, NULL)/*err*/) {
+                syslog(LOG_ERR, "%s: Invalid amount: %s", order, amount);
+                e = false;
+            }
+        }
+        free(l);
+        if (e) {
+            e = mpay_refund_many(mpay, v, vsz, (arg2)?atoi(arg2):8, arg1);
+            for (size_t i=0; i<vsz; i++) {
+                printf("%s %s\n", v[i].order, names[v[i].status]);
+            }
+        }
+        for (size_t i=0; i<vsz; i++) free((char *)v[i].order);
+        free(v);
+        if (!e/*err*/) goto cleanup;
+
+    } else if (!strcmp(cmd, "subs-add")) {
+
+        struct mpay_subs *v     = NULL, *v2;
+        size_t            vsz   = 0;
+        char            **lines = NULL, **lines2;
+        size_t            nl    = 0;
+        char             *l     = NULL;
+        size_t            lsz   = 0;
+        bool              from_stdin;
+        if (!arg1/*err*/) goto cleanup_invalid_args;
+        from_stdin = (_argc == 3);
+        e = true;
+        while (e) {
+            char            *a[102] = {cmd}, *opts[100], *save = NULL;
+            struct mpay_form form   = {0};
+            int              n      = 1;
+            if (from_stdin) {
+                if (getline(&l, &lsz, stdin) == -1) break;
+                e = (lines2 = realloc(lines, (nl+1)*sizeof(char *))) != NULL;
+                if (!e/*err*/) break;
+                lines = lines2;
+                e = (lines[nl] = strdup(l)) != NULL;
+                if (!e/*err*/) break;
+                for (char *t = strtok_r(lines[nl++], " \t\r\n", &save); t && n<101; t = strtok_r(NULL, " \t\r\n", &save)) {
+                    a[n++] = t;
+                }
+                if (n == 1) continue;
+                streq2map(a, 100, opts);
+            } else {
+                streq2map(args, 100, opts);
+            }
+            e = mpay_form_prepare(&form, MPAY_FORM_SUBSCRIPTION, opts);
+            if (!e/*err*/) break;
+            e = (v2 = realloc(v, (vsz+1)*sizeof(struct mpay_subs))) != NULL;
+            if (!e/*err*/) break;
+            v = v2;
+            v[vsz].id          = form.payment.order;
+            v[vsz].idUser      = form.payment.idUser;
+            v[vsz].tokenUser   = form.payment.tokenUser;
+            v[vsz].amount      = form.payment.amount;
+            v[vsz].periodicity = (form.subscription.periodicity)?form.subscription.periodicity:30;
+            v[vsz].start_date  = form.subscription.start_date;
+            v[vsz].end_date    = form.subscription.end_date;
+            vsz++;
+            if (!from_stdin) break;
+        }
+        free(l);
+        if (e) e = mpay_subs_add(arg1, v, vsz);
+        for (size_t i=0; i<nl; i++) free(lines[i]);
+        free(lines);
+        free(v);
+        if (!e/*err*/) goto cleanup;
+
+    } else if (!strcmp(cmd, "subs-cancel")) {
+
+        if (!arg1 || !arg2/*err*/) goto cleanup_invalid_args;
+        e = mpay_subs_cancel(arg1, arg2);
+        if (!e/*err*/) goto cleanup;
+
+    } else if (!strcmp(cmd, "subs-list")) {
+
+        if (!arg1/*err*/) goto cleanup_invalid_args;
+        e = mpay_subs_list(arg1, stdout);
+        if (!e/*err*/) goto cleanup;
+
+    } else if (!strcmp(cmd, "subs-run")) {
+
+        struct mpay_subs_stats st = {0};
+        if (!arg1 || !arg2/*err*/) goto cleanup_invalid_args;
+        e = mpay_subs_run(mpay, arg1, time(NULL), arg2,
+                          (_argc>4)?atoi(_argv[4]):8,
+                          (_argc>5)?strtod(_argv[5], NULL):0,
+                          &st);
+        printf("due %lu charged %lu refused %lu canceled %lu unknown %lu\n",
+               st.due, st.charged, st.refused, st.canceled, st.unknown);
+        if (!e/*err*/) goto cleanup;
+
     } else {
 
         syslog(LOG_ERR, "Invalid subcommand: %s", cmd);
@@ -185,8 +356,10 @@ int main (int _argc, char *_argv[]) {
     syslog(LOG_ERR, "Invalid arguments.");
     goto cleanup;
  cleanup:
+    if (mpay && getenv("PAYCOMET_STATS")) mpay_print_stats(mpay, stderr);
     if (mpay)  mpay_destroy(mpay);
     if (json1) json_decref(json1);
+    mpay_trace_stop();
     
     return ret;
 }
@@ -8,36 +8,203 @@
 #include <types/long_ss.h>
 #include <types/time_ss.h>
 #include <curl/crest.h>
+#include <curl/curl.h>
 #include <jansson/extra.h>
 #include <syslog.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <limits.h>
 #ifdef NO_GETTEXT
 #  define _(T) T
 #else
 #  include <libintl.h>
 #  define _(T) dgettext("c-mpaycomet", T)
 #endif
+#ifndef VARDIR
+#  define VARDIR "/var/lib"
+#endif
+#define MPAY_CACHE_DEFAULT VARDIR "/mpaycomet/cache"
+
+struct mpay_rec {
+    const char *url;
+    const char *body;
+    const char *ctype;
+    char       *d;
+    size_t      dsz;
+    long        rcode;
+    long        start;
+    long        usec;
+    bool        used;
+};
+
+struct mpay_buf {
+    char   *d;
+    size_t  dsz;
+    size_t  asz;
+};
+
+enum mpay_phase {
+    MPAY_PHASE_AUTH,
+    MPAY_PHASE_BUILD,
+    MPAY_PHASE_ACQUIRE,
+    MPAY_PHASE_DNS,
+    MPAY_PHASE_CONNECT,
+    MPAY_PHASE_TLS,
+    MPAY_PHASE_SEND,
+    MPAY_PHASE_WAIT,
+    MPAY_PHASE_RECEIVE,
+    MPAY_PHASE_DECODE,
+    MPAY_PHASES
+};
+
+struct mpay_span {
+    const char      *name;
+    char             order[48];
+    unsigned long    id[2];
+    unsigned long    tid;
+    unsigned long    start_us;
+    unsigned long    dur_us;
+    long             rcode;
+    long             error_code;
+    enum mpay_error  error;
+    bool             ok;
+    bool             coalesced;
+    unsigned int     phase_at[MPAY_PHASES]; /* Microseconds since the start. */
+    unsigned int     phase_us[MPAY_PHASES];
+};
+
+struct mpay_trace {
+    bool             on;
+    bool             sampled;
+    struct timespec  t0;
+    struct timespec  tl;
+    struct mpay_span span;
+};
 
 struct mpay {
-    crest  *crest;
     str256  auth_api_token;
     long    auth_terminal;
     bool    auth_ok;
+    /* Network transport. */
+    CURL              *curl;
+    CURLSH            *share;
+    pthread_mutex_t    share_lock[CURL_LOCK_DATA_LAST];
+    struct curl_slist *headers;
+    struct mpay_buf    resp;
+    char               resp_ctype[128];
+    bool               encoding_on;
+    char               encoding[64];
+    bool               coalesce;
+    enum mpay_priority priority;
+    enum mpay_error    error;
+    struct mpay_trace  trace;
+    /* Record/replay transport. */
+    enum mpay_transport transport;
+    int              rec_fd;
+    char            *rec_d;
+    struct mpay_rec *rec_v;
+    size_t           rec_vsz;
+    size_t           rec_pos;
+    struct timespec  rec_t0;
+    /* Pre-warming, keep-alive and statistics. */
+    pthread_mutex_t    warm_lock;
+    pthread_mutex_t    curl_lock; /* Transfers on `curl`. */
+    pthread_cond_t     warm_cond;
+    pthread_t          warm_thread;
+    bool               warm_running;
+    bool               warm_stop;
+    bool               warm_prewarm;
+    int                warm_keepalive;
+    struct timespec    warm_last;
+    struct mpay_stats  stats;
+    /* On-disk DNS cache. */
+    char              *cache_file;
+    struct curl_slist *cache_resolve;
+    char               cache_dns[1024];
+    /* Non-blocking operations. */
+    CURLM             *multi;
+    mpay_op_watch_f    op_watch;
+    mpay_op_timer_f    op_timer;
+    void              *op_udata;
+    mpay_op           *op_done_first;
+    mpay_op           *op_done_last;
+    mpay_op           *op_pending_first;
+    mpay_op           *op_pending_last;
+    mpay_op           *op_replay_first;
+    int                op_count;
+    struct timespec    op_timer_at;
+    bool               op_timer_on;
+    bool               op_timer_ours;
 };
 
 const char *MPAY_URL = "https://rest.paycomet.com";
 
+static bool mpay_cache_save   (mpay *_mpay);
+static void mpay_cache_update (mpay *_mpay, CURL *_curl, const char *_url);
+static void mpay_trace_begin  (struct mpay_trace *_t, const char *_name, const char *_order);
+static void mpay_trace_mark   (struct mpay_trace *_t, enum mpay_phase _p);
+static void mpay_trace_curl   (struct mpay_trace *_t, CURL *_curl, bool _failed);
+static void mpay_trace_end    (struct mpay_trace *_t, json_t *_j, long _rcode, bool _ok, enum mpay_error _error);
+
+static pthread_once_t mpay_curl_once = PTHREAD_ONCE_INIT;
+
+static void mpay_curl_init(void) {
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+}
+
+static void mpay_share_lock(CURL *_curl, curl_lock_data _data, curl_lock_access _access, void *_udata) {
+    pthread_mutex_lock(&((mpay *)_udata)->share_lock[_data]);
+}
+
+static void mpay_share_unlock(CURL *_curl, curl_lock_data _data, void *_udata) {
+    pthread_mutex_unlock(&((mpay *)_udata)->share_lock[_data]);
+}
+
 bool mpay_create(mpay **_mpay) {
-    mpay          *mpay;
-    int            e;
+    mpay               *mpay;
+    pthread_condattr_t  ca;
+    pthread_once(&mpay_curl_once, mpay_curl_init);
     mpay = calloc(1, sizeof(struct mpay));
     if (!mpay/*err*/) goto cleanup_errno;
-    e = crest_create(&mpay->crest);
-    if (!e/*err*/) goto cleanup;
+    mpay->rec_fd = -1;
+    mpay->encoding_on = true;
+    mpay->coalesce    = true;
+    for (int i=0; i<CURL_LOCK_DATA_LAST; i++) {
+        pthread_mutex_init(&mpay->share_lock[i], NULL);
+    }
+    pthread_mutex_init(&mpay->warm_lock, NULL);
+    pthread_mutex_init(&mpay->curl_lock, NULL);
+    pthread_condattr_init(&ca);
+    pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+    pthread_cond_init(&mpay->warm_cond, &ca);
+    pthread_condattr_destroy(&ca);
+    /* DNS and TLS sessions are shared by all transfers of the handle.
+     * Connections are not, libcurl can't share them between threads
+     * transferring at once: the warm-up thread uses the request handle
+     * itself (see mpay_probe()). */
+    mpay->share = curl_share_init();
+    if (!mpay->share/*err*/) goto cleanup_curl;
+    curl_share_setopt(mpay->share, CURLSHOPT_LOCKFUNC  , mpay_share_lock);
+    curl_share_setopt(mpay->share, CURLSHOPT_UNLOCKFUNC, mpay_share_unlock);
+    curl_share_setopt(mpay->share, CURLSHOPT_USERDATA  , mpay);
+    curl_share_setopt(mpay->share, CURLSHOPT_SHARE     , CURL_LOCK_DATA_DNS);
+    curl_share_setopt(mpay->share, CURLSHOPT_SHARE     , CURL_LOCK_DATA_SSL_SESSION);
+    mpay->curl = curl_easy_init();
+    if (!mpay->curl/*err*/) goto cleanup_curl;
     *_mpay = mpay;
     return true;
  cleanup_errno:
     syslog(LOG_ERR, "%s", strerror(errno));
     goto cleanup;
+ cleanup_curl:
+    syslog(LOG_ERR, "Can't initialize libcurl.");
+    goto cleanup;
  cleanup:
     mpay_destroy(mpay);
     return false;
@@ -45,14 +212,41 @@ bool mpay_create(mpay **_mpay) {
 
 void mpay_destroy(mpay *_mpay) {
     if (_mpay) {
-        if (_mpay->crest) {
-            crest_destroy(_mpay->crest);
+        pthread_mutex_lock(&_mpay->warm_lock);
+        _mpay->warm_stop = true;
+        pthread_cond_signal(&_mpay->warm_cond);
+        pthread_mutex_unlock(&_mpay->warm_lock);
+        if (_mpay->warm_running) {
+            pthread_join(_mpay->warm_thread, NULL);
+        }
+        if (_mpay->cache_file && _mpay->stats.requests+_mpay->stats.probes) {
+            mpay_cache_save(_mpay);
         }
+        mpay_set_cache(_mpay, NULL);
+        if (_mpay->multi) {
+            curl_multi_cleanup(_mpay->multi);
+        }
+        if (_mpay->curl) {
+            curl_easy_cleanup(_mpay->curl);
+        }
+        if (_mpay->share) {
+            curl_share_cleanup(_mpay->share);
+        }
+        curl_slist_free_all(_mpay->headers);
+        free(_mpay->resp.d);
+        mpay_set_transport(_mpay, MPAY_TRANSPORT_NETWORK, NULL);
+        for (int i=0; i<CURL_LOCK_DATA_LAST; i++) {
+            pthread_mutex_destroy(&_mpay->share_lock[i]);
+        }
+        pthread_mutex_destroy(&_mpay->warm_lock);
+        pthread_mutex_destroy(&_mpay->curl_lock);
+        pthread_cond_destroy(&_mpay->warm_cond);
         free(_mpay);
     }
 }
 
 void mpay_set_auth(mpay *_mpay, const char *_api_token, const char *_terminal) {
+    pthread_mutex_lock(&_mpay->warm_lock);
     _mpay->auth_ok = false;
     if (_api_token) {
         strncpy(_mpay->auth_api_token, _api_token, sizeof(_mpay->auth_api_token)-1);
@@ -61,6 +255,28 @@ void mpay_set_auth(mpay *_mpay, const char *_api_token, const char *_terminal) {
         int e = long_parse(&_mpay->auth_terminal, _terminal, NULL);
         if (!e/*err*/) { _mpay->auth_terminal = -1; }
     }
+    pthread_mutex_unlock(&_mpay->warm_lock);
+}
+
+static struct curl_slist *mpay_headers(const char *_api_token) {
+    struct curl_slist *l = NULL, *n;
+    char               auth[sizeof(str256)+32];
+    const char        *h[] = {
+        "Content-Type: application/json",
+        "Accept: application/json",
+        auth,
+        NULL
+    };
+    snprintf(auth, sizeof(auth), "PAYCOMET-API-TOKEN: %s", _api_token);
+    for (int i=0; h[i]; i++) {
+        n = curl_slist_append(l, h[i]);
+        if (!n/*err*/) {
+            curl_slist_free_all(l);
+            return NULL;
+        }
+        l = n;
+    }
+    return l;
 }
 
 bool mpay_chk_auth(mpay *_mpay, const char **_reason) {
@@ -75,549 +291,3676 @@ bool mpay_chk_auth(mpay *_mpay, const char **_reason) {
             if(_reason) *_reason = _("Missing API token");
             return false;
         }
-        int e = crest_set_auth_header(_mpay->crest,
-                                      "PAYCOMET-API-TOKEN: %s",
-                                      _mpay->auth_api_token);
-        if (!e) {
+        struct curl_slist *h = mpay_headers(_mpay->auth_api_token);
+        if (!h) {
             if(_reason) *_reason = _("Internal error");
             return false;
         }
+        curl_slist_free_all(_mpay->headers);
+        _mpay->headers = h;
     }
     _mpay->auth_ok = true;
+    mpay_trace_mark(&_mpay->trace, MPAY_PHASE_AUTH);
     return true;
 }
 
-bool mpay_heartbeat(mpay *_mpay, FILE *_fp1) {
-    bool           retval          = false;
-    crest_result   hr              = {0};
-    FILE          *fp              = NULL;
-    json_t        *j1              = NULL;
-    int            e;
-    e = mpay_chk_auth(_mpay, NULL);
-    if (!e/*err*/) return false;
-    e = crest_start_url(_mpay->crest, "%s/v1/heartbeat", MPAY_URL);
-    if (!e/*err*/) goto cleanup;
-    e = crest_post_data(_mpay->crest, CREST_CONTENT_TYPE_JSON, &fp);
-    if (!e/*err*/) goto cleanup;
-    e = fprintf(fp, "{\"terminal\": %li}", _mpay->auth_terminal);
-    if (e<0/*err*/) goto cleanup_errno;
-    e = crest_perform(_mpay->crest, &hr.ctype, &hr.rcode, &hr.d, &hr.dsz);
-    if (!e/*err*/) goto cleanup;
-    e = crest_get_json(&j1, hr.ctype, hr.rcode, hr.d, hr.dsz);
-    if (!e/*err*/) goto cleanup;
-    const char *ping_paycomet      = json_object_get_string (j1, "time");
-    const char *ping_processor     = json_object_get_string (j1, "processorTime");
-    e = ping_paycomet && ping_processor;
-    if (!e/*err*/) goto cleanup_invalid_response;
-    if (_fp1) {
-        fprintf(_fp1, "Paycomet ping     : %s\n", ping_paycomet);
-        fprintf(_fp1, "Processor ping    : %s\n", ping_processor);
+/* ---- Transport: network, record and replay. ----
+ *
+ * Recorded files are a sequence of records with the following format,
+ * where each length excludes the trailing newline:
+ *
+ *   MPR2 START USEC RCODE URL-LEN BODY-LEN CTYPE-LEN RESPONSE-LEN\n
+ *   URL\n BODY\n CTYPE\n RESPONSE\n
+ *
+ * START is the time the request was sent, in microseconds since the
+ * recording started, and USEC the time it took. An RCODE of 0 marks a
+ * request without response (network failure), a CTYPE-LEN of -1 a
+ * response without content type (empty line). Records of the older
+ * MPR1 format lack START and are read as sent at the start.
+ */
+
+static bool mpay_rec_load(mpay *_mpay, const char *_file) {
+    FILE            *fp  = NULL;
+    char            *d   = NULL;
+    struct mpay_rec *v   = NULL, *v2;
+    size_t           vsz = 0, dsz, pos = 0;
+    long             l;
+    int              e;
+    fp = fopen(_file, "rb");
+    if (!fp/*err*/) goto cleanup_errno;
+    e = fseek(fp, 0, SEEK_END);
+    if (e==-1/*err*/) goto cleanup_errno;
+    l = ftell(fp);
+    if (l==-1/*err*/) goto cleanup_errno;
+    rewind(fp);
+    dsz = l;
+    d = malloc(dsz+1);
+    if (!d/*err*/) goto cleanup_errno;
+    if (fread(d, 1, dsz, fp) != dsz/*err*/) goto cleanup_errno;
+    d[dsz] = '\0';
+    while (pos < dsz) {
+        struct mpay_rec  r = {0};
+        size_t           len[4];
+        char            *fld[4];
+        long             ctype_len;
+        int              n = 0;
+        e = sscanf(d+pos, "MPR2 %li %li %li %zu %zu %li %zu%n",
+                   &r.start, &r.usec, &r.rcode, &len[0], &len[1], &ctype_len, &len[3], &n);
+        if (e!=7) {
+            e = sscanf(d+pos, "MPR1 %li %li %zu %zu %li %zu%n",
+                       &r.usec, &r.rcode, &len[0], &len[1], &ctype_len, &len[3], &n)+1;
+        }
+        if (e!=7 || ctype_len < -1 || d[pos+n]!='\n'/*err*/) goto cleanup_invalid;
+        len[2] = (ctype_len == -1)?0:ctype_len;
+        pos += n+1;
+        for (int i=0; i<4; i++) {
+            if (len[i] >= dsz-pos || d[pos+len[i]] != '\n'/*err*/) goto cleanup_invalid;
+            fld[i] = d+pos;
+            fld[i][len[i]] = '\0';
+            pos += len[i]+1;
+        }
+        r.url   = fld[0];
+        r.body  = fld[1];
+        r.ctype = (ctype_len == -1)?NULL:fld[2];
+        r.d     = fld[3];
+        r.dsz   = len[3];
+        v2 = realloc(v, sizeof(struct mpay_rec)*(vsz+1));
+        if (!v2/*err*/) goto cleanup_errno;
+        v = v2;
+        v[vsz++] = r;
     }
-    retval = true;
- cleanup:
-    if (j1) json_decref(j1);
-    return retval;
+    free(_mpay->rec_d);
+    free(_mpay->rec_v);
+    _mpay->rec_d   = d;
+    _mpay->rec_v   = v;
+    _mpay->rec_vsz = vsz;
+    _mpay->rec_pos = 0;
+    fclose(fp);
+    return true;
  cleanup_errno:
-    syslog(LOG_ERR, "%s", strerror(errno));
+    syslog(LOG_ERR, "%s: %s", _file, strerror(errno));
     goto cleanup;
- cleanup_invalid_response:
-    syslog(LOG_ERR, "Received invalid response:\n%.*s", (int)hr.dsz, hr.d);
+ cleanup_invalid:
+    syslog(LOG_ERR, "%s: Invalid record at offset %zu.", _file, pos);
     goto cleanup;
+ cleanup:
+    if (fp) fclose(fp);
+    free(d);
+    free(v);
+    return false;
 }
 
-bool mpay_methods_get(mpay *_mpay, json_t **_r) {
-    crest_result   hr              = {0};
-    bool           retval          = false;
-    FILE          *fp              = NULL;
-    json_t        *j1              = NULL;
-    int            e;
-    e = mpay_chk_auth(_mpay, NULL);
-    if (!e/*err*/) return false;
-    e = crest_start_url(_mpay->crest, "%s/v1/methods", MPAY_URL);
-    if (!e/*err*/) goto cleanup;
-    e = crest_post_data(_mpay->crest, CREST_CONTENT_TYPE_JSON, &fp);
-    if (!e/*err*/) goto cleanup;
-    e = fprintf(fp, "{\"terminal\": %li}", _mpay->auth_terminal);
-    if (e<0/*err*/) goto cleanup_errno;
-    e = crest_perform(_mpay->crest, &hr.ctype, &hr.rcode, &hr.d, &hr.dsz);
-    if (!e/*err*/) goto cleanup;
-    e = crest_get_json(&j1, hr.ctype, hr.rcode, hr.d, hr.dsz);
-    if (!e/*err*/) goto cleanup;
-    if (_r) {
-        *_r = json_incref(j1);
-    }
-    retval = true;
- cleanup:
-    if (j1) json_decref(j1);
-    return retval;
+static long mpay_usec(struct timespec *_t1, struct timespec *_t2) {
+    return (_t2->tv_sec-_t1->tv_sec)*1000000+(_t2->tv_nsec-_t1->tv_nsec)/1000;
+}
+
+static bool mpay_rec_append(mpay *_mpay, const char *_url, const char *_body, crest_result *_rh,
+                            struct timespec *_t1, struct timespec *_t2) {
+    char       *b     = NULL;
+    size_t      bsz   = 0;
+    FILE       *fp    = NULL;
+    const char *ctype = (_rh->ctype)?_rh->ctype:"";
+    ssize_t     w;
+    fp = open_memstream(&b, &bsz);
+    if (!fp/*err*/) goto cleanup_errno;
+    fprintf(fp, "MPR2 %li %li %li %zu %zu %li %zu\n",
+            mpay_usec(&_mpay->rec_t0, _t1), mpay_usec(_t1, _t2), (long)_rh->rcode,
+            strlen(_url), strlen(_body), (_rh->ctype)?(long)strlen(ctype):-1L, (size_t)_rh->dsz);
+    fprintf(fp, "%s\n%s\n%s\n", _url, _body, ctype);
+    fwrite(_rh->d, 1, _rh->dsz, fp);
+    fputc('\n', fp);
+    if (fclose(fp)==EOF/*err*/) { fp = NULL; goto cleanup_errno; }
+    fp = NULL;
+    /* A single write on an O_APPEND descriptor keeps records whole. */
+    w = write(_mpay->rec_fd, b, bsz);
+    if (w != (ssize_t)bsz/*err*/) goto cleanup_errno;
+    free(b);
+    return true;
  cleanup_errno:
-    syslog(LOG_ERR, "%s", strerror(errno));
-    goto cleanup;
+    syslog(LOG_ERR, "Recording: %s", strerror(errno));
+    if (fp) fclose(fp);
+    free(b);
+    return false;
 }
 
-bool mpay_exchange(mpay *_mpay, coin_t _fr, coin_t *_to, const char *_currency) {
-    
-    bool           r               = false;
-    crest_result   hr              = {0};
-    FILE          *fp              = NULL;
-    json_t        *resp_j          = NULL,*j2;
-    int            e;
-    
-    e = mpay_chk_auth(_mpay, NULL);
-    if (!e/*err*/) return false;
-    e = crest_start_url(_mpay->crest, "%s/v1/exchange", MPAY_URL);
-    if (!e/*err*/) goto cleanup;
-    e = crest_post_data(_mpay->crest, CREST_CONTENT_TYPE_JSON, &fp);
-    if (!e/*err*/) goto cleanup;
-    strncpy(_to->currency, _currency, sizeof(_to->currency)-1);
-    for (char *c=_fr.currency; *c; c++)  *c=toupper(*c);
-    for (char *c=_to->currency; *c; c++) *c=toupper(*c);
-    e = fprintf(fp,
-                "{"
-                "    \"terminal\"        : %li, "   "\n"
-                "    \"amount\"          : %li,"    "\n"
-                "    \"originalCurrency\": \"%s\"," "\n"
-                "    \"finalCurrency\"   : \"%s\""  "\n"
-                "}"                                 "\n",
-                _mpay->auth_terminal,
-                _fr.cents,
-                _fr.currency,
-                _to->currency);
-    if (e<0/*err*/) goto cleanup_errno;
-    e = crest_perform(_mpay->crest, &hr.ctype, &hr.rcode, &hr.d, &hr.dsz);
-    if (!e/*err*/) goto cleanup;
-    e = crest_get_json(&resp_j, hr.ctype, hr.rcode, hr.d, hr.dsz);
-    if (!e/*err*/) goto cleanup;
-    j2 = json_object_get(resp_j, "amount");
-    e = j2 && json_is_number(j2);
-    if (!e/*err*/) goto cleanup_invalid_response;
-    _to->cents = json_number_value(j2);
-    r = true;
- cleanup:
-    if (resp_j) json_decref(resp_j);
+static void mpay_rec_failure(mpay *_mpay, const char *_url, const char *_body, struct timespec *_t1) {
+    crest_result    rh = {0};
+    struct timespec t2;
+    if (_mpay->transport != MPAY_TRANSPORT_RECORD) return;
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+    rh.d = "";
+    mpay_rec_append(_mpay, _url, _body, &rh, _t1, &t2);
+}
+
+static struct mpay_rec *mpay_rec_find(mpay *_mpay, const char *_url, const char *_body) {
+    struct mpay_rec *r = NULL;
+    /* Prefer the next unused record so a recorded session replays in
+     * order in O(1), then fall back to any matching record so that the
+     * same file can be replayed in loops. */
+    for (int pass = 0; pass < 2 && !r; pass++) {
+        for (size_t n = 0; n < _mpay->rec_vsz; n++) {
+            size_t i = (_mpay->rec_pos + n) % _mpay->rec_vsz;
+            if ((pass == 0 && _mpay->rec_v[i].used) ||
+                strcmp(_mpay->rec_v[i].url, _url) ||
+                strcmp(_mpay->rec_v[i].body, _body)) {
+                continue;
+            }
+            r = &_mpay->rec_v[i];
+            _mpay->rec_pos = i+1;
+            break;
+        }
+    }
+    if (!r/*err*/) {
+        syslog(LOG_ERR, "Replay: No recorded response for %s", _url);
+        return NULL;
+    }
+    r->used = true;
     return r;
- cleanup_errno:
-    syslog(LOG_ERR, "%s", strerror(errno));
-    goto cleanup;
- cleanup_invalid_response:
-    syslog(LOG_ERR, "Invalid response from paycomet: %.*s", (int)hr.dsz, hr.d);
-    goto cleanup;
 }
 
-bool mpay_form_prepare(struct mpay_form *_f, enum mpay_operationType type, char *_opts[]) {
-    
-    char         **opt;
-    char         **dst_s;
-    int           *dst_i;
-    time_t        *dst_t;
-    long           l;
-    int            e;
+static bool mpay_rec_result(struct mpay_rec *_r, crest_result *_rh, enum mpay_error *_error) {
+    if (!_r/*err*/) return false;
+    if (!_r->rcode/*err*/) {
+        syslog(LOG_ERR, "%s: Replay: Recorded network failure.", _r->url);
+        *_error = MPAY_ERROR_NETWORK;
+        return false;
+    }
+    _rh->ctype = _r->ctype;
+    _rh->rcode = _r->rcode;
+    _rh->d     = _r->d;
+    _rh->dsz   = _r->dsz;
+    return true;
+}
 
-    _f->operationType = type;
-    _f->payment.methods[0] = MPAY_METHOD_CARD;
-    for (opt = _opts; _opts && *opt; opt+=2) {
-        if (!strcasecmp(*opt, "amount")) {
-            e = coin_parse(&_f->payment.amount, *(opt+1), NULL);
-            if (!e/*err*/) return false;
-        } else if ((dst_s = str2ptr
-                    (*opt, strcasecmp,
-                     "language"           , &_f->language,
-                     "description"        , &_f->productDescription,
-                     "productDescription" , &_f->productDescription,
-                     "merchantDescription", &_f->payment.merchantDescription,
-                     "order"              , &_f->payment.order,
-                     "tokenUser"          , &_f->payment.tokenUser,
-                     "scoring"            , &_f->payment.scoring,
-                     "url_success"        , &_f->payment.urlOk,
-                     "urlOk"              , &_f->payment.urlOk,
-                     "url_cancel"         , &_f->payment.urlKo,
-                     "urlKo"              , &_f->payment.urlKo,
-                     NULL))) {
-            *dst_s = *(opt+1);
-        } else if ((dst_i = str2ptr
-                    (*opt, strcasecmp,
-                     "idUser"         , &_f->payment.idUser,
-                     "secure"         , &_f->payment.secure,
-                     "userInteraction", &_f->payment.userInteraction,
-                     "periodicity"    , &_f->subscription.periodicity,
-                     NULL))) {
-            e = long_parse(&l, *(opt+1), NULL);
-            if (!e/*err*/) return false;
-            *dst_i = l;
-        } else if ((dst_t = str2ptr
-                    (*opt, strcasecmp,
-                     "date_start", &_f->subscription.start_date,
-                     "date_end"  , &_f->subscription.end_date,
-                     NULL))) {
-            e = time_day_parse(dst_t, *(opt+1), NULL);
-            if (!e/*err*/) return false;
+static bool mpay_rec_replay(mpay *_mpay, crest_result *_rh, const char *_url, const char *_body) {
+    struct mpay_rec *r = mpay_rec_find(_mpay, _url, _body);
+    if (r && _mpay->transport == MPAY_TRANSPORT_REPLAY_TIMED && r->usec > 0) {
+        struct timespec ts = {r->usec/1000000, (r->usec%1000000)*1000};
+        while (nanosleep(&ts, &ts)==-1 && errno==EINTR) {}
+    }
+    return mpay_rec_result(r, _rh, &_mpay->error);
+}
+
+bool mpay_set_transport(mpay *_mpay, enum mpay_transport _transport, const char *_file) {
+    if (_mpay->rec_fd != -1) {
+        close(_mpay->rec_fd);
+        _mpay->rec_fd = -1;
+    }
+    free(_mpay->rec_d);
+    free(_mpay->rec_v);
+    _mpay->rec_d     = NULL;
+    _mpay->rec_v     = NULL;
+    _mpay->rec_vsz   = 0;
+    _mpay->rec_pos   = 0;
+    _mpay->transport = MPAY_TRANSPORT_NETWORK;
+    switch (_transport) {
+    case MPAY_TRANSPORT_NETWORK:
+        break;
+    case MPAY_TRANSPORT_RECORD:
+        _mpay->rec_fd = open(_file, O_WRONLY|O_APPEND|O_CREAT|O_CLOEXEC, 0600);
+        if (_mpay->rec_fd==-1/*err*/) {
+            syslog(LOG_ERR, "%s: %s", _file, strerror(errno));
+            return false;
         }
-        
+        clock_gettime(CLOCK_MONOTONIC, &_mpay->rec_t0);
+        break;
+    case MPAY_TRANSPORT_REPLAY:
+    case MPAY_TRANSPORT_REPLAY_TIMED:
+        if (!mpay_rec_load(_mpay, _file)/*err*/) return false;
+        break;
     }
+    _mpay->transport = _transport;
     return true;
 }
 
-json_t *mpay_form_to_json(mpay *_mpay, struct mpay_form *_f) {
-    json_t *body = NULL;
-    if (_f->operationType==MPAY_FORM_INVALID) {
-        syslog(LOG_ERR, "mpay_form: Missing operationType.");
-        return NULL;
-    } else if (_f->operationType == MPAY_FORM_TOKENIZATION) {
+static size_t mpay_buf_write(char *_d, size_t _sz, size_t _n, void *_udata) {
+    struct mpay_buf *b = _udata;
+    size_t           l = _sz*_n;
+    if (b->dsz+l+1 > b->asz) {
+        size_t  asz = (b->asz)?b->asz:4096;
+        char   *d;
+        while (asz < b->dsz+l+1) asz *= 2;
+        d = realloc(b->d, asz);
+        if (!d/*err*/) return 0;
+        b->d   = d;
+        b->asz = asz;
+    }
+    memcpy(b->d+b->dsz, _d, l);
+    b->dsz += l;
+    b->d[b->dsz] = '\0';
+    return l;
+}
 
+/* Responses are inflated by libcurl as they arrive, one chunk at a
+ * time, so only the decoded body is kept in memory. */
+bool mpay_set_compression(mpay *_mpay, const char *_encodings) {
+    if (!_encodings) {
+        _mpay->encoding_on = false;
+        return true;
+    }
+    if (strlen(_encodings) >= sizeof(_mpay->encoding)/*err*/) {
+        syslog(LOG_ERR, "Invalid encoding list: %s", _encodings);
+        return false;
+    }
+    strcpy(_mpay->encoding, _encodings);
+    _mpay->encoding_on = true;
+    return true;
+}
+
+static void mpay_curl_setup(mpay *_mpay, CURL *_curl, struct curl_slist *_headers,
+                            const char *_url, const char *_body, struct mpay_buf *_b) {
+    curl_easy_setopt(_curl, CURLOPT_URL           , _url);
+    curl_easy_setopt(_curl, CURLOPT_SHARE         , _mpay->share);
+    curl_easy_setopt(_curl, CURLOPT_RESOLVE       , _mpay->cache_resolve);
+    curl_easy_setopt(_curl, CURLOPT_HTTPHEADER    , _headers);
+    curl_easy_setopt(_curl, CURLOPT_POSTFIELDS    , _body);
+    curl_easy_setopt(_curl, CURLOPT_POSTFIELDSIZE , (long)strlen(_body));
+    curl_easy_setopt(_curl, CURLOPT_WRITEFUNCTION , mpay_buf_write);
+    curl_easy_setopt(_curl, CURLOPT_WRITEDATA     , _b);
+    curl_easy_setopt(_curl, CURLOPT_NOSIGNAL      , 1L);
+    curl_easy_setopt(_curl, CURLOPT_TCP_KEEPALIVE , 1L);
+    curl_easy_setopt(_curl, CURLOPT_ACCEPT_ENCODING, (_mpay->encoding_on)?_mpay->encoding:NULL);
+    curl_easy_setopt(_curl, CURLOPT_CONNECTTIMEOUT, 30L);
+    curl_easy_setopt(_curl, CURLOPT_TIMEOUT       , 120L);
+}
+
+static void mpay_perform_end(mpay *_mpay, CURL *_curl, const char *_url, const char *_body,
+                             struct mpay_buf *_b, struct timespec *_t1, crest_result *_rh,
+                             struct mpay_trace *_t) {
+    char            *ctype    = NULL;
+    long             rcode    = 0;
+    long             connects = 0;
+    curl_off_t       t_dns = 0, t_connect = 0, t_tls = 0, t_total = 0;
+    curl_off_t       wire     = 0;
+    struct timespec  t2;
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+    mpay_trace_curl(_t, _curl, false);
+    curl_easy_getinfo(_curl, CURLINFO_RESPONSE_CODE    , &rcode);
+    curl_easy_getinfo(_curl, CURLINFO_CONTENT_TYPE     , &ctype);
+    curl_easy_getinfo(_curl, CURLINFO_NUM_CONNECTS     , &connects);
+    curl_easy_getinfo(_curl, CURLINFO_NAMELOOKUP_TIME_T, &t_dns);
+    curl_easy_getinfo(_curl, CURLINFO_CONNECT_TIME_T   , &t_connect);
+    curl_easy_getinfo(_curl, CURLINFO_APPCONNECT_TIME_T, &t_tls);
+    curl_easy_getinfo(_curl, CURLINFO_TOTAL_TIME_T     , &t_total);
+    curl_easy_getinfo(_curl, CURLINFO_SIZE_DOWNLOAD_T  , &wire);
+    if (_mpay->cache_file && connects) {
+        mpay_cache_update(_mpay, _curl, _url);
+    }
+    _rh->ctype = ctype;
+    _rh->rcode = rcode;
+    _rh->d     = (_b->d)?_b->d:"";
+    _rh->dsz   = _b->dsz;
+    pthread_mutex_lock(&_mpay->warm_lock);
+    _mpay->stats.requests++;
+    if (connects) {
+        _mpay->stats.cold++;
     } else {
-        if (!_f->payment.amount.cents || !_f->payment.amount.currency[0]) {
-            syslog(LOG_ERR, "Missing parameter: `amount=100eur`.");
-            return NULL;
-        }
-        if (!_f->payment.order) {
-            syslog(LOG_ERR, "Missing parameter: `order=REF`.");
-            return NULL;
-        }
+        _mpay->stats.warm++;
     }
-        
-    body = json_object();
-    json_object_set_integer(body, "operationType", _f->operationType);
-    if (_f->language) {
-        json_object_set_string(body, "language", _f->language);
+    _mpay->stats.usec_dns     += t_dns;
+    _mpay->stats.usec_connect += (t_connect > t_dns)?t_connect-t_dns:0;
+    _mpay->stats.usec_tls     += (t_tls > t_connect)?t_tls-t_connect:0;
+    _mpay->stats.usec_total   += t_total;
+    _mpay->stats.bytes_wire   += wire;
+    _mpay->stats.bytes_body   += _b->dsz;
+    _mpay->warm_last = t2;
+    pthread_mutex_unlock(&_mpay->warm_lock);
+    if (_mpay->transport == MPAY_TRANSPORT_RECORD) {
+        /* A failure recording does not make the request fail. */
+        mpay_rec_append(_mpay, _url, _body, _rh, _t1, &t2);
     }
-    json_object_set_integer(body, "terminal", _mpay->auth_terminal);
-    if (_f->operationType == MPAY_FORM_TOKENIZATION) {
-        if (_f->productDescription) {
-            json_object_set_string(body, "productDescription", _f->productDescription);
+}
+
+/* ---- Scheduler. ----
+ *
+ * Interactive and background requests of all handles share a budget
+ * of connections. Interactive requests go first and have `reserved`
+ * slots of their own. Background requests wait while interactive ones
+ * are queued, and are shed when too many are queued or they waited for
+ * too long. Blocking calls wait here, operations wait in their handle
+ * (see mpay_op_admit()).
+ *
+ * With mpay_sched_adaptive() the budget follows PAYCOMET's latency as
+ * the gradient limit of Netflix's concurrency-limits: it shrinks when
+ * the recent round trip time grows over the long term average and grows
+ * by a small queue allowance while it does not, and it is cut by a
+ * tenth on network errors. At most half of it is reserved. Requests
+ * held back by it alone (not by `max_inflight` nor by queued interactive
+ * requests) wait up to `limit_wait_ms` and then fail with
+ * MPAY_ERROR_LIMIT. */
+
+#define MPAY_SCHED_RTT_TOLERANCE 1.5
+#define MPAY_SCHED_RTT_WARMUP    10
+#define MPAY_SCHED_RTT_LONG      600
+#define MPAY_SCHED_SMOOTHING     0.2
+
+static struct {
+    pthread_mutex_t          lock;
+    pthread_cond_t           cond;
+    int                      max_queued;
+    int                      max_wait_ms;
+    /* Adaptive limit. */
+    bool                     adaptive;
+    int                      limit_min;
+    int                      limit_max;
+    int                      limit_wait_ms;
+    double                   limit;
+    double                   rtt_short;
+    double                   rtt_long;
+    unsigned long            rtt_samples;
+    struct mpay_sched_stats  s;
+} mpay_sched = {.lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+
+static bool mpay_sched_fits(enum mpay_priority _p, unsigned long _limit) {
+    unsigned long n        = mpay_sched.s.prio[0].inflight+mpay_sched.s.prio[1].inflight;
+    unsigned long limit    = _limit;
+    unsigned long reserved = mpay_sched.s.reserved;
+    if (!limit) {
+        return true;
+    } else if (_p == MPAY_PRIORITY_INTERACTIVE) {
+        return n < limit;
+    } else {
+        if (reserved > limit/2) {
+            /* An adaptive limit can fall under the reserve. */
+            reserved = limit/2;
         }
+        return n+reserved < limit &&
+            !mpay_sched.s.prio[MPAY_PRIORITY_INTERACTIVE].queued;
+    }
+}
+
+static bool mpay_sched_can(enum mpay_priority _p) {
+    return mpay_sched_fits(_p, mpay_sched.s.limit);
+}
+
+/* Whether the adaptive limit is what keeps `_p` from running. */
+static bool mpay_sched_limited(enum mpay_priority _p) {
+    return mpay_sched.adaptive && mpay_sched_fits(_p, mpay_sched.s.max_inflight);
+}
+
+/* The limit in effect, the adaptive one when lower than the static one. */
+static void mpay_sched_set_limit(void) {
+    mpay_sched.s.limit = mpay_sched.s.max_inflight;
+    if (mpay_sched.adaptive && (!mpay_sched.s.limit || mpay_sched.limit < mpay_sched.s.limit)) {
+        mpay_sched.s.limit = mpay_sched.limit;
+    }
+}
+
+static void mpay_sched_sample(unsigned long _us, bool _dropped) {
+    unsigned long n     = mpay_sched.s.prio[0].inflight+mpay_sched.s.prio[1].inflight;
+    double        limit = mpay_sched.limit;
+    double        gradient;
+    if (!mpay_sched.adaptive) return;
+    if (_dropped) {
+        limit *= 0.9;
     } else {
-        json_t *payment = json_object(); long_ss l_ss;
-        json_object_set_integer(payment, "terminal", _mpay->auth_terminal);
-        if (_f->payment.methods[0]) {
-            json_object_set(payment, "methods", __extension__ ({
-                        json_t *m  = json_array();
-                        for (int i=0; i<10 && _f->payment.methods[i]; i++) {
-                            json_array_append(m, json_integer(_f->payment.methods[i]));
-                        }
-                        m;
-                    }));
+        mpay_sched.rtt_samples++;
+        if (mpay_sched.rtt_samples == 1) {
+            mpay_sched.rtt_short = mpay_sched.rtt_long = _us;
+        } else if (mpay_sched.rtt_samples <= MPAY_SCHED_RTT_WARMUP) {
+            mpay_sched.rtt_short += (_us-mpay_sched.rtt_short)*MPAY_SCHED_SMOOTHING;
+            mpay_sched.rtt_long  += (_us-mpay_sched.rtt_long)/mpay_sched.rtt_samples;
+        } else {
+            mpay_sched.rtt_short += (_us-mpay_sched.rtt_short)*MPAY_SCHED_SMOOTHING;
+            mpay_sched.rtt_long  += (_us-mpay_sched.rtt_long)/MPAY_SCHED_RTT_LONG;
         }
-        if (_f->payment.excludedMethods[0]) {
-            json_object_set(payment, "excludedMethods", __extension__ ({
-                        json_t *m = json_array();
-                        for (int i=0; i<10 && _f->payment.excludedMethods[i]; i++) {
-                            json_array_append(m, json_integer(_f->payment.excludedMethods[i]));
-                        }
-                        m;
-                    }));
+        if (mpay_sched.rtt_long > 2*mpay_sched.rtt_short) {
+            /* Latency dropped for good, do not wait for the average. */
+            mpay_sched.rtt_long *= 0.95;
         }
-        if (_f->payment.order) {
-            json_object_set_string(payment, "order", _f->payment.order);
+        if (mpay_sched.rtt_samples >= MPAY_SCHED_RTT_WARMUP && n >= limit/2) {
+            gradient = MPAY_SCHED_RTT_TOLERANCE*mpay_sched.rtt_long/mpay_sched.rtt_short;
+            if (gradient > 1.0) gradient = 1.0;
+            if (gradient < 0.5) gradient = 0.5;
+            limit += (limit*gradient+1+limit/16-limit)*MPAY_SCHED_SMOOTHING;
         }
-        json_object_set_string(payment, "amount", ulong_str(_f->payment.amount.cents, &l_ss));
-        json_object_set_string(payment, "currency", __extension__ ({
-                    for (char *c=_f->payment.amount.currency; *c; c++) {
-                        *c = toupper(*c);
-                    }
-                    _f->payment.amount.currency;
-                }));
-        if (_f->payment.idUser>0) {
-            json_object_set_integer(payment, "idUser", _f->payment.idUser);
-        }
-        if (_f->payment.tokenUser) {
-            json_object_set_string(payment, "tokenUser", _f->payment.tokenUser);
-        }
-        json_object_set_integer(payment, "secure", _f->payment.secure);
-        if (_f->payment.scoring) {
-            json_object_set_string(payment, "scoring", _f->payment.scoring);
-        }
-        if (_f->productDescription) {
-            json_object_set_string(payment, "productDescription", _f->productDescription);
-        }
-        if (_f->payment.merchantDescription) {
-            json_object_set_string(payment, "merchantDescription", _f->payment.merchantDescription);
-        }
-        json_object_set_integer(payment, "userInteraction", _f->payment.userInteraction);
-        if (_f->payment.urlOk) {
-            json_object_set_string(payment, "urlOk", _f->payment.urlOk);
-        }
-        if (_f->payment.urlKo) {
-            json_object_set_string(payment, "urlKo", _f->payment.urlKo);
-        }
-        json_object_set(body, "payment", payment);
     }
-    if (_f->operationType == MPAY_FORM_SUBSCRIPTION) {
-        json_t        *subscription_j  = json_object();
-        struct tm      tm              = {0};
-        char           txt[20]         = {0};
-        time_t         date_start      = 0;
-        time_t         date_end        = 0;
-        int            periodicity     = 0;
-        
-        if (_f->subscription.start_date) {
-            date_start = _f->subscription.start_date;
-        } else {
-            date_start = time(NULL);
+    if (limit < mpay_sched.limit_min) limit = mpay_sched.limit_min;
+    if (limit > mpay_sched.limit_max) limit = mpay_sched.limit_max;
+    mpay_sched.limit           = limit;
+    mpay_sched.s.usec_rtt      = mpay_sched.rtt_short;
+    mpay_sched.s.usec_rtt_long = mpay_sched.rtt_long;
+    mpay_sched_set_limit();
+}
+
+static void mpay_sched_admitted(enum mpay_priority _p, struct timespec *_t1) {
+    struct timespec t2;
+    unsigned long   us;
+    mpay_sched.s.prio[_p].inflight++;
+    mpay_sched.s.prio[_p].admitted++;
+    if (_t1) {
+        clock_gettime(CLOCK_MONOTONIC, &t2);
+        us = (t2.tv_sec-_t1->tv_sec)*1000000+(t2.tv_nsec-_t1->tv_nsec)/1000;
+        mpay_sched.s.prio[_p].delayed++;
+        mpay_sched.s.prio[_p].usec_wait += us;
+        if (us > mpay_sched.s.prio[_p].usec_wait_max) {
+            mpay_sched.s.prio[_p].usec_wait_max = us;
         }
+    }
+}
 
-        if (_f->subscription.end_date) {
-            date_end = _f->subscription.end_date;
-        } else {
-            date_end = time(NULL)+(3600*24*364*5);
+static bool mpay_sched_queue(enum mpay_priority _p) {
+    if (_p == MPAY_PRIORITY_BACKGROUND && mpay_sched.max_queued &&
+        mpay_sched.s.prio[_p].queued >= mpay_sched.max_queued) {
+        mpay_sched.s.prio[_p].shed++;
+        return false;
+    }
+    if (++mpay_sched.s.prio[_p].queued > mpay_sched.s.prio[_p].queued_max) {
+        mpay_sched.s.prio[_p].queued_max = mpay_sched.s.prio[_p].queued;
+    }
+    return true;
+}
+
+/* Milliseconds a queued request can still wait, -1 forever, 0 when
+ * it waited too long (it is then counted as shed or limited). The
+ * adaptive wait only applies while the adaptive limit holds it. */
+static long mpay_sched_left(enum mpay_priority _p, struct timespec *_t1, enum mpay_error *_error) {
+    struct timespec t2;
+    long            ms, left = -1;
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+    ms = (t2.tv_sec-_t1->tv_sec)*1000+(t2.tv_nsec-_t1->tv_nsec)/1000000;
+    *_error = MPAY_ERROR_NONE;
+    if (_p == MPAY_PRIORITY_BACKGROUND && mpay_sched.max_wait_ms) {
+        left = mpay_sched.max_wait_ms-ms;
+        if (left <= 0) {
+            mpay_sched.s.prio[_p].shed++;
+            *_error = MPAY_ERROR_SHED;
+            return 0;
+        }
+    }
+    if (mpay_sched_limited(_p)) {
+        if (mpay_sched.limit_wait_ms-ms <= 0) {
+            mpay_sched.s.prio[_p].limited++;
+            *_error = MPAY_ERROR_LIMIT;
+            return 0;
+        } else if (left < 0 || mpay_sched.limit_wait_ms-ms < left) {
+            left = mpay_sched.limit_wait_ms-ms;
         }
+    }
+    return left;
+}
 
-        if (_f->subscription.periodicity) {
-            periodicity = _f->subscription.periodicity;
+static enum mpay_error mpay_sched_acquire(enum mpay_priority _p) {
+    struct timespec t1, deadline;
+    enum mpay_error r = MPAY_ERROR_NONE;
+    long            left;
+    pthread_mutex_lock(&mpay_sched.lock);
+    if (mpay_sched_can(_p)) {
+        mpay_sched_admitted(_p, NULL);
+        pthread_mutex_unlock(&mpay_sched.lock);
+        return MPAY_ERROR_NONE;
+    }
+    if (mpay_sched_limited(_p) && !mpay_sched.limit_wait_ms) {
+        mpay_sched.s.prio[_p].limited++;
+        pthread_mutex_unlock(&mpay_sched.lock);
+        return MPAY_ERROR_LIMIT;
+    }
+    if (!mpay_sched_queue(_p)) {
+        pthread_mutex_unlock(&mpay_sched.lock);
+        return MPAY_ERROR_SHED;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    while (!mpay_sched_can(_p)) {
+        left = mpay_sched_left(_p, &t1, &r);
+        if (r != MPAY_ERROR_NONE) {
+            break;
+        } else if (left > 0) {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec  += left/1000;
+            deadline.tv_nsec += (left%1000)*1000000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&mpay_sched.cond, &mpay_sched.lock, &deadline);
         } else {
-            periodicity = 30;
+            pthread_cond_wait(&mpay_sched.cond, &mpay_sched.lock);
         }
-    
-        localtime_r(&date_start, &tm);
-        snprintf(txt, sizeof(txt)-1, "%04i%02i%02i", tm.tm_year+1900, tm.tm_mon+1, tm.tm_mday);
-        json_object_set_string(subscription_j, "startDate", txt);
-        
-        localtime_r(&date_end, &tm);
-        snprintf(txt, sizeof(txt)-1, "%04i%02i%02i", tm.tm_year+1900, tm.tm_mon+1, tm.tm_mday);
-        json_object_set_string(subscription_j, "endDate", txt);
-
-        snprintf(txt, sizeof(txt)-1, "%i", periodicity);
-        json_object_set_string(subscription_j, "periodicity", txt);
-
-        json_object_set(body, "subscription", subscription_j);
     }
-        
+    mpay_sched.s.prio[_p].queued--;
+    if (r == MPAY_ERROR_NONE) {
+        mpay_sched_admitted(_p, &t1);
+    }
+    /* Queued background requests wait for this one. */
+    pthread_cond_broadcast(&mpay_sched.cond);
+    pthread_mutex_unlock(&mpay_sched.lock);
+    return r;
+}
 
-        
-        
-    
-    return body;
+/* Give back the slot, with the round trip time of the request when
+ * `_t1` (its start) is given. */
+static void mpay_sched_release(enum mpay_priority _p, struct timespec *_t1, bool _dropped) {
+    struct timespec t2;
+    pthread_mutex_lock(&mpay_sched.lock);
+    if (_t1) {
+        clock_gettime(CLOCK_MONOTONIC, &t2);
+        mpay_sched_sample((t2.tv_sec-_t1->tv_sec)*1000000+(t2.tv_nsec-_t1->tv_nsec)/1000, _dropped);
+    }
+    mpay_sched.s.prio[_p].inflight--;
+    pthread_cond_broadcast(&mpay_sched.cond);
+    pthread_mutex_unlock(&mpay_sched.lock);
 }
 
-bool mpay_form(mpay *_mpay, struct mpay_form *_form, char **_url_m) {
-    
-    json_t        *req             = NULL;
-    bool           retval          = false;
-    FILE          *fp              = NULL;
-    crest_result   rh              = {0};
-    json_t        *response        = NULL;
-    const char    *url             = NULL;
-    int            e;
+void mpay_sched_configure(int _max_inflight, int _reserved, int _max_queued, int _max_wait_ms) {
+    pthread_mutex_lock(&mpay_sched.lock);
+    mpay_sched.s.max_inflight = (_max_inflight > 0)?_max_inflight:0;
+    mpay_sched.s.reserved     = (_reserved > 0 && _reserved < _max_inflight)?_reserved:0;
+    mpay_sched.max_queued     = (_max_queued > 0)?_max_queued:0;
+    mpay_sched.max_wait_ms    = (_max_wait_ms > 0)?_max_wait_ms:0;
+    mpay_sched_set_limit();
+    pthread_cond_broadcast(&mpay_sched.cond);
+    pthread_mutex_unlock(&mpay_sched.lock);
+}
 
-    /* Check _mpay has the credentials. */
-    e = mpay_chk_auth(_mpay, NULL);
-    if (!e/*err*/) return false;
+void mpay_sched_adaptive(int _min_limit, int _max_limit, int _max_wait_ms) {
+    pthread_mutex_lock(&mpay_sched.lock);
+    mpay_sched.adaptive      = (_max_limit > 0);
+    mpay_sched.limit_min     = (_min_limit > 0)?_min_limit:1;
+    mpay_sched.limit_max     = (_max_limit > mpay_sched.limit_min)?_max_limit:mpay_sched.limit_min;
+    mpay_sched.limit_wait_ms = (_max_wait_ms > 0)?_max_wait_ms:0;
+    mpay_sched.limit         = (mpay_sched.limit_max < 20)?mpay_sched.limit_max:20;
+    if (mpay_sched.limit < mpay_sched.limit_min) mpay_sched.limit = mpay_sched.limit_min;
+    mpay_sched.rtt_short     = 0;
+    mpay_sched.rtt_long      = 0;
+    mpay_sched.rtt_samples   = 0;
+    mpay_sched_set_limit();
+    pthread_cond_broadcast(&mpay_sched.cond);
+    pthread_mutex_unlock(&mpay_sched.lock);
+}
 
-    /* Convert C struct to Json. */
-    req = mpay_form_to_json(_mpay, _form);
-    if (!req/*err*/) goto cleanup;
+void mpay_sched_get_stats(struct mpay_sched_stats *_s) {
+    pthread_mutex_lock(&mpay_sched.lock);
+    *_s = mpay_sched.s;
+    pthread_mutex_unlock(&mpay_sched.lock);
+}
 
-    /* Set the requested url. */
-    e = crest_start_url(_mpay->crest, "%s/v1/form", MPAY_URL);
-    if (!e/*err*/) goto cleanup;
+void mpay_sched_print_stats(FILE *_fp) {
+    static const char       *names[] = {"Interactive", "Background"};
+    struct mpay_sched_stats  s;
+    mpay_sched_get_stats(&s);
+    fprintf(_fp, "Scheduler limit   : %i of %i (%i reserved)\n", s.limit, s.max_inflight, s.reserved);
+    if (s.usec_rtt) {
+        fprintf(_fp, "Round trip time   : %.3f ms recent, %.3f ms long term\n",
+                s.usec_rtt/1000.0, s.usec_rtt_long/1000.0);
+    }
+    for (int p=0; p<2; p++) {
+        fprintf(_fp, "%-18s: %lu admitted, %lu delayed, %lu shed, %lu limited, %lu queued (max %lu)\n",
+                names[p], s.prio[p].admitted, s.prio[p].delayed, s.prio[p].shed,
+                s.prio[p].limited, s.prio[p].queued, s.prio[p].queued_max);
+        if (s.prio[p].delayed) {
+            fprintf(_fp, "%-18s: %.3f ms avg, %.3f ms max\n", "    wait",
+                    s.prio[p].usec_wait/1000.0/s.prio[p].delayed,
+                    s.prio[p].usec_wait_max/1000.0);
+        }
+    }
+}
 
-    /* Set the request body. */
-    e = crest_post_data(_mpay->crest, CREST_CONTENT_TYPE_JSON, &fp);
-    if (!e/*err*/) goto cleanup;
-    e = json_dumpf(req, fp, JSON_INDENT(4));
-    if (e<0/*err*/) goto c_errno;
+void mpay_set_priority(mpay *_mpay, enum mpay_priority _priority) {
+    _mpay->priority = _priority;
+}
 
-    /* Perform the request and get response. */
-    e = crest_perform(_mpay->crest, &rh.ctype, &rh.rcode, &rh.d, &rh.dsz);
-    if (!e/*err*/) goto cleanup;
-    e = crest_get_json(&response, rh.ctype, rh.rcode, rh.d, rh.dsz);
-    if (!e/*err*/) goto cleanup;
+enum mpay_error mpay_last_error(mpay *_mpay) {
+    return _mpay->error;
+}
 
-    /* Print the JSON (When debugging) */
-    json_dumpf(response, stderr, JSON_INDENT(4));
-    
-    /* Get URL. */
-    url = json_object_get_string(response, "challengeUrl");
-    if (!url/*err*/) goto c_invalid_response;
-    if (_url_m) {
-        *_url_m = strdup(url);
-        if (!*_url_m/*err*/) goto c_errno;
+static bool mpay_perform_url(mpay *_mpay, crest_result *_rh, const char *_body, const char *_url) {
+    struct timespec  t1;
+    CURLcode         ce;
+    _mpay->error = MPAY_ERROR_NONE;
+    mpay_trace_mark(&_mpay->trace, MPAY_PHASE_BUILD);
+    if (_mpay->transport == MPAY_TRANSPORT_REPLAY ||
+        _mpay->transport == MPAY_TRANSPORT_REPLAY_TIMED) {
+        return mpay_rec_replay(_mpay, _rh, _url, _body);
     }
+    _mpay->error = mpay_sched_acquire(_mpay->priority);
+    mpay_trace_mark(&_mpay->trace, MPAY_PHASE_ACQUIRE);
+    if (_mpay->error != MPAY_ERROR_NONE/*err*/) {
+        syslog(LOG_ERR, "%s: %s by the scheduler.", _url,
+               (_mpay->error == MPAY_ERROR_LIMIT)?"Rejected":"Shed");
+        return false;
+    }
+    _mpay->resp.dsz = 0;
+    pthread_mutex_lock(&_mpay->curl_lock);
+    mpay_curl_setup(_mpay, _mpay->curl, _mpay->headers, _url, _body, &_mpay->resp);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    ce = curl_easy_perform(_mpay->curl);
+    mpay_sched_release(_mpay->priority, &t1, ce != CURLE_OK);
+    if (ce != CURLE_OK/*err*/) {
+        mpay_trace_curl(&_mpay->trace, _mpay->curl, true);
+        pthread_mutex_unlock(&_mpay->curl_lock);
+        syslog(LOG_ERR, "%s: %s", _url, curl_easy_strerror(ce));
+        _mpay->error = MPAY_ERROR_NETWORK;
+        mpay_rec_failure(_mpay, _url, _body, &t1);
+        return false;
+    }
+    mpay_perform_end(_mpay, _mpay->curl, _url, _body, &_mpay->resp, &t1, _rh, &_mpay->trace);
+    pthread_mutex_unlock(&_mpay->curl_lock);
+    return true;
+}
 
-    /* Returns. */
-    retval = true;
+static bool mpay_perform(mpay *_mpay, crest_result *_rh, const char *_body, const char *_url_fmt, ...) {
+    bool             retval = false;
+    char            *url    = NULL;
+    va_list          va;
+    int              e;
+    va_start(va, _url_fmt);
+    e = vasprintf(&url, _url_fmt, va);
+    va_end(va);
+    if (e==-1/*err*/) { url = NULL; goto cleanup_errno; }
+    retval = mpay_perform_url(_mpay, _rh, _body, url);
  cleanup:
-    json_decref(response);
+    free(url);
     return retval;
- c_errno:
+ cleanup_errno:
     syslog(LOG_ERR, "%s", strerror(errno));
     goto cleanup;
- c_invalid_response:
-    syslog(LOG_ERR, "Invalid response:\n%.*s", (int)rh.dsz, rh.d);
-    goto cleanup;
 }
 
-bool mpay_payment_info(mpay *_mpay,
-                       const char *_order,
-                       enum mpay_payment_state *_opt_state,
-                       json_t    **_opt_info,
-                       json_t    **_opt_history) {
-    int          e;
-    bool         ret = false;
-    FILE        *fp  = NULL;
-    json_t      *j   = NULL, *j_payment, *j_state, *j_history, *j_err;
-    int          n;
-    crest_result rh;
+/* ---- Single-flight. ----
+ *
+ * Identical read-only requests (payment info, exchange) made while one
+ * is in flight anywhere in the process wait for it and share its
+ * response instead of sending their own. The key is the priority class,
+ * the API token, the URL (with the order) and the body (with the
+ * terminal and amounts). Interactive calls never join a background
+ * request, that may still be queued and be shed by the scheduler. */
 
-    /* Check _mpay has the credentials. */
-    e = mpay_chk_auth(_mpay, NULL);
-    if (!e/*err*/) return false;
+struct mpay_flight {
+    struct mpay_flight *next;
+    char               *key;
+    int                 waiters;
+    bool                done;
+    bool                ok;
+    enum mpay_error     error;
+    long                rcode;
+    char               *ctype;
+    char               *d;
+    size_t              dsz;
+};
 
-    /* Set the requested url. */
-    e = crest_start_url(_mpay->crest, "%s/v1/payments/%s/info", MPAY_URL, _order);
-    if (!e/*err*/) goto cleanup;
+static pthread_mutex_t     mpay_flight_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t      mpay_flight_cond = PTHREAD_COND_INITIALIZER;
+static struct mpay_flight *mpay_flights     = NULL;
 
-    /* Set the request body. */
-    e = crest_post_data(_mpay->crest, CREST_CONTENT_TYPE_JSON, &fp);
-    if (!e/*err*/) goto cleanup;
-    e = fprintf(fp, "{\"terminal\": %li}", _mpay->auth_terminal);
-    if (e<0/*err*/) goto cleanup_errno;
+static void mpay_flight_free(struct mpay_flight *_f) {
+    free(_f->key);
+    free(_f->ctype);
+    free(_f->d);
+    free(_f);
+}
 
-    /* Perform the request and get response. */
-    e = crest_perform(_mpay->crest, &rh.ctype, &rh.rcode, &rh.d, &rh.dsz);
-    if (!e/*err*/) goto cleanup;
-    e = crest_get_json(&j, rh.ctype, rh.rcode, rh.d, rh.dsz);
-    if (!e/*err*/) goto cleanup;
+static bool mpay_flight_publish(struct mpay_flight *_f, crest_result *_rh) {
+    if (_rh->ctype) {
+        _f->ctype = strdup(_rh->ctype);
+        if (!_f->ctype/*err*/) return false;
+    }
+    _f->d = malloc(_rh->dsz+1);
+    if (!_f->d/*err*/) return false;
+    memcpy(_f->d, _rh->d, _rh->dsz);
+    _f->d[_rh->dsz] = '\0';
+    _f->dsz   = _rh->dsz;
+    _f->rcode = _rh->rcode;
+    return true;
+}
 
-    /* Handle normal error cases. */
-    j_err = json_object_get(j, "errorCode");
-    if (j_err &&
-        json_is_integer(j_err) &&
-        ((n=json_integer_value(j_err)) >= 300 || n==130)) {
-        if (_opt_state)   *_opt_state   = MPAY_PAYMENT_UNFINISHED;
-        if (_opt_history) *_opt_history = json_array();
-        if (_opt_info)    *_opt_info    = json_object();
-        ret = true;
+static bool mpay_flight_receive(mpay *_mpay, struct mpay_flight *_f, crest_result *_rh) {
+    _mpay->resp.dsz = 0;
+    if (_f->dsz && !mpay_buf_write(_f->d, 1, _f->dsz, &_mpay->resp)/*err*/) return false;
+    if (_f->ctype) {
+        strncpy(_mpay->resp_ctype, _f->ctype, sizeof(_mpay->resp_ctype)-1);
+    }
+    _rh->ctype = (_f->ctype)?_mpay->resp_ctype:NULL;
+    _rh->rcode = _f->rcode;
+    _rh->d     = (_mpay->resp.d)?_mpay->resp.d:"";
+    _rh->dsz   = _mpay->resp.dsz;
+    return true;
+}
+
+static bool mpay_perform_shared(mpay *_mpay, crest_result *_rh, const char *_body, const char *_url_fmt, ...) {
+    bool                 retval = false;
+    char                *url    = NULL;
+    char                *key    = NULL;
+    struct mpay_flight  *f;
+    struct mpay_flight **fp;
+    va_list              va;
+    int                  e;
+    va_start(va, _url_fmt);
+    e = vasprintf(&url, _url_fmt, va);
+    va_end(va);
+    if (e==-1/*err*/) { url = NULL; goto cleanup_errno; }
+    if (!_mpay->coalesce ||
+        _mpay->transport == MPAY_TRANSPORT_REPLAY ||
+        _mpay->transport == MPAY_TRANSPORT_REPLAY_TIMED) {
+        retval = mpay_perform_url(_mpay, _rh, _body, url);
         goto cleanup;
     }
-    j_payment = json_object_get(j, "payment");
-    e = j_payment && json_is_object(j_payment);
-    if (!e/*err*/) goto cleanup_invalid_response;
-    j_state = json_object_get(j_payment, "state");
-    e = j_state && json_is_integer(j_state);
-    if (!e/*err*/) goto cleanup_invalid_response;
-    j_history = json_object_get(j_payment, "history");
-    e = j_history && json_is_array(j_history);
-    if (!e/*err*/) goto cleanup_invalid_response;
-    if (_opt_state) {
-        long s = json_integer_value(j_state);
-        if (s != 0 && s != 1 && s != 2/*err*/) goto cleanup_invalid_response;
-        if (e == 1) {
-            json_t *e; int i;
-            json_array_foreach(j_history, i, e) {
-                long c = json_object_get_integer(e, "operationType");
-                if (c == 2) {
-                    s = MPAY_PAYMENT_REFUNDED;
-                    break;
-                }
-            }
-            
+    e = asprintf(&key, "%i\n%s\n%s\n%s", _mpay->priority, _mpay->auth_api_token, url, _body);
+    if (e==-1/*err*/) { key = NULL; goto cleanup_errno; }
+    pthread_mutex_lock(&mpay_flight_lock);
+    for (f = mpay_flights; f && strcmp(f->key, key); f = f->next) {}
+    if (f) {
+        /* Another request is in flight, wait for its response. */
+        f->waiters++;
+        mpay_trace_mark(&_mpay->trace, MPAY_PHASE_BUILD);
+        while (!f->done) {
+            pthread_cond_wait(&mpay_flight_cond, &mpay_flight_lock);
         }
-        
-        *_opt_state = s;
+        mpay_trace_mark(&_mpay->trace, MPAY_PHASE_WAIT);
+        _mpay->trace.span.coalesced = true;
+        retval = f->ok && mpay_flight_receive(_mpay, f, _rh);
+        _mpay->error = f->error;
+        if (--f->waiters == 0) {
+            mpay_flight_free(f);
+        }
+        pthread_mutex_unlock(&mpay_flight_lock);
+        pthread_mutex_lock(&_mpay->warm_lock);
+        _mpay->stats.coalesced++;
+        pthread_mutex_unlock(&_mpay->warm_lock);
+        goto cleanup;
     }
-    if (_opt_history) {
-        *_opt_history = json_incref(j_history);
+    f = calloc(1, sizeof(struct mpay_flight));
+    if (!f/*err*/) { pthread_mutex_unlock(&mpay_flight_lock); goto cleanup_errno; }
+    f->key = key; key = NULL;
+    f->next = mpay_flights;
+    mpay_flights = f;
+    pthread_mutex_unlock(&mpay_flight_lock);
+    retval = mpay_perform_url(_mpay, _rh, _body, url);
+    pthread_mutex_lock(&mpay_flight_lock);
+    for (fp = &mpay_flights; *fp != f; fp = &(*fp)->next) {}
+    *fp = f->next;
+    f->ok    = retval && (!f->waiters || mpay_flight_publish(f, _rh));
+    f->error = _mpay->error;
+    f->done = true;
+    if (f->waiters) {
+        pthread_cond_broadcast(&mpay_flight_cond);
+    } else {
+        mpay_flight_free(f);
     }
-    if (_opt_info) {
-        json_object_del(j_payment, "history");
-        *_opt_info = json_incref(j_payment);
-    }    
-    ret = true;
+    pthread_mutex_unlock(&mpay_flight_lock);
  cleanup:
-    if (j) json_decref(j);
-    return ret;
+    free(url);
+    free(key);
+    return retval;
  cleanup_errno:
     syslog(LOG_ERR, "%s", strerror(errno));
     goto cleanup;
- cleanup_invalid_response:
-    syslog(LOG_ERR, "Invalid response: %.*s", (int)rh.dsz, rh.d);
-    goto cleanup;
 }
 
-json_t *payment_info_to_refund(json_t *_i, coin_t _opt_different_amount) {
-    json_t *o = json_object();
-    json_t *i_terminal = json_incref(json_object_get(_i, "terminal"));
-    json_t *i_amount   = __extension__ ({
-            json_t *j; long_ss ls;
-            if (_opt_different_amount.cents) {
-                j = json_string(long_str(_opt_different_amount.cents, &ls));
-            } else {
-                j = json_incref(json_object_get(_i, "amount"));
-            }
-            j;
-        });
-    json_t *i_currency = __extension__ ({
-            json_t *j; char *s,*p;
-            if (_opt_different_amount.cents) {
-                s = strdupa(_opt_different_amount.currency);
-                for (p = s; *p; p++) *p = toupper(*p);
-                j = json_string(s);
-            } else {
-                j = json_incref(json_object_get(_i, "currency"));
-            }
-            j;
-        });
-    json_t *i_authCode   = json_incref(json_object_get(_i, "authCode"));
-    json_t *i_originalIp = json_incref(json_object_get(_i, "originalIp"));
-    int res = o && i_terminal && i_amount && i_currency && i_authCode && i_originalIp;
-    if (!res/*err*/) {
-        json_decref(o);
-        json_decref(i_terminal);
-        json_decref(i_amount);
-        json_decref(i_currency);
-        json_decref(i_authCode);
-        json_decref(i_originalIp);
-        return NULL;
+void mpay_set_coalesce(mpay *_mpay, bool _on) {
+    _mpay->coalesce = _on;
+}
+
+/* ---- On-disk DNS cache. ----
+ *
+ * One-shot invocations start cold. The cache file keeps the address
+ * of the PAYCOMET host between processes:
+ *
+ *   dns HOST PORT ADDRESS EXPIRES
+ *
+ * The address is handed to libcurl with CURLOPT_RESOLVE, so a request
+ * that used it reports it back as its primary IP. Only a different
+ * address (a real lookup) restarts the expiry, otherwise the host
+ * would never be resolved again.
+ *
+ * Readers take a shared lock and writers an exclusive one. */
+
+#define MPAY_CACHE_DNS_TTL 600
+
+static bool mpay_cache_load(mpay *_mpay) {
+    int     fd   = -1;
+    FILE   *fp   = NULL;
+    char   *line = NULL;
+    size_t  linesz = 0;
+    time_t  now  = time(NULL);
+    fd = open(_mpay->cache_file, O_RDONLY|O_CLOEXEC);
+    if (fd==-1 && errno==ENOENT) return true;
+    if (fd==-1/*err*/) goto cleanup_errno;
+    if (flock(fd, LOCK_SH)==-1/*err*/) goto cleanup_errno;
+    fp = fdopen(fd, "r");
+    if (!fp/*err*/) goto cleanup_errno;
+    fd = -1;
+    while (getline(&line, &linesz, fp) != -1) {
+        char  f[3][256];
+        long  expires;
+        if (sscanf(line, "dns %255s %255s %255s %li", f[0], f[1], f[2], &expires)==4) {
+            struct curl_slist *n;
+            char               entry[sizeof(f)+16];
+            if (expires <= now) continue;
+            /* The '+' makes libcurl expire it as a normal DNS entry. */
+            snprintf(entry, sizeof(entry),
+                     (strchr(f[2], ':'))?"+%s:%s:[%s]":"+%s:%s:%s", f[0], f[1], f[2]);
+            n = curl_slist_append(_mpay->cache_resolve, entry);
+            if (!n/*err*/) goto cleanup_errno;
+            _mpay->cache_resolve = n;
+            snprintf(_mpay->cache_dns, sizeof(_mpay->cache_dns), "%s %s %s %li", f[0], f[1], f[2], expires);
+        }
     }
-    json_t *p = json_object();
-    json_object_set(p, "terminal"  , i_terminal);
-    json_object_set(p, "amount"    , i_amount);
-    json_object_set(p, "currency"  , i_currency);
-    json_object_set(p, "authCode"  , i_authCode);
-    json_object_set(p, "originalIp", i_originalIp);
-    json_object_set(o, "payment", p);
-    return o;
+    fclose(fp);
+    free(line);
+    return true;
+ cleanup_errno:
+    syslog(LOG_ERR, "%s: %s", _mpay->cache_file, strerror(errno));
+    if (fd!=-1) close(fd);
+    if (fp) fclose(fp);
+    free(line);
+    return false;
 }
 
-bool mpay_payment_refund(mpay *_mpay,
-                         const char *_order,
-                         json_t     *_info,
-                         coin_t      _opt_different_amount,
-                         json_t    **_opt_result) {
-    int          e;
-    bool         ret = false;
-    json_t      *req = NULL;
-    FILE        *fp;
-    crest_result hr;
-    json_t      *j   = NULL;
-    req = payment_info_to_refund(_info, _opt_different_amount);
-    if (!req/*err*/) goto cleanup;
+static bool mpay_cache_save(mpay *_mpay) {
+    int     fd = -1;
+    char   *b  = NULL;
+    size_t  bsz = 0;
+    FILE   *fp;
+    fp = open_memstream(&b, &bsz);
+    if (!fp/*err*/) goto cleanup_errno;
+    if (_mpay->cache_dns[0]) {
+        fprintf(fp, "dns %s\n", _mpay->cache_dns);
+    }
+    if (fclose(fp)==EOF/*err*/) goto cleanup_errno;
+    fd = open(_mpay->cache_file, O_WRONLY|O_CREAT|O_CLOEXEC, 0600);
+    if (fd==-1/*err*/) goto cleanup_errno;
+    if (flock(fd, LOCK_EX)==-1/*err*/) goto cleanup_errno;
+    if (ftruncate(fd, 0)==-1/*err*/) goto cleanup_errno;
+    if (write(fd, b, bsz)!=(ssize_t)bsz/*err*/) goto cleanup_errno;
+    close(fd);
+    free(b);
+    return true;
+ cleanup_errno:
+    syslog(LOG_ERR, "%s: %s", _mpay->cache_file, strerror(errno));
+    if (fd!=-1) close(fd);
+    free(b);
+    return false;
+}
+
+static void mpay_cache_update(mpay *_mpay, CURL *_curl, const char *_url) {
+    CURLU *u    = curl_url();
+    char  *host = NULL;
+    char  *port = NULL;
+    char  *ip   = NULL;
+    char   f[3][256];
+    long   expires;
+    if (u &&
+        curl_url_set(u, CURLUPART_URL, _url, 0) == CURLUE_OK &&
+        curl_url_get(u, CURLUPART_HOST, &host, 0) == CURLUE_OK &&
+        curl_url_get(u, CURLUPART_PORT, &port, CURLU_DEFAULT_PORT) == CURLUE_OK &&
+        curl_easy_getinfo(_curl, CURLINFO_PRIMARY_IP, &ip) == CURLE_OK && ip && ip[0]) {
+        /* The cached address came back, keep its expiry. */
+        if (sscanf(_mpay->cache_dns, "%255s %255s %255s %li", f[0], f[1], f[2], &expires)==4 &&
+            !strcmp(f[0], host) && !strcmp(f[1], port) && !strcmp(f[2], ip)) {
+            goto cleanup;
+        }
+        snprintf(_mpay->cache_dns, sizeof(_mpay->cache_dns), "%s %s %s %li",
+                 host, port, ip, (long)time(NULL)+MPAY_CACHE_DNS_TTL);
+    }
+ cleanup:
+    curl_free(host);
+    curl_free(port);
+    curl_url_cleanup(u);
+}
+
+bool mpay_set_cache(mpay *_mpay, const char *_file) {
+    free(_mpay->cache_file);
+    _mpay->cache_file = NULL;
+    _mpay->cache_dns[0] = '\0';
+    curl_slist_free_all(_mpay->cache_resolve);
+    _mpay->cache_resolve = NULL;
+    if (!_file) return true;
+    _mpay->cache_file = strdup(_file);
+    if (!_mpay->cache_file/*err*/) {
+        syslog(LOG_ERR, "%s", strerror(errno));
+        return false;
+    }
+    /* A missing or unreadable cache is not an error, it starts cold. */
+    mpay_cache_load(_mpay);
+    return true;
+}
+
+/* ---- Pre-warming and keep-alive. ----
+ *
+ * A thread sends heartbeats through the request handle, once after
+ * mpay_prewarm() and whenever the connection was idle for the
+ * keep-alive interval. Requests then find the connection open. The
+ * handle's `curl_lock` keeps a heartbeat and a request from using the
+ * request handle at once: a request arriving during a heartbeat waits
+ * for it, a heartbeat due during a request is skipped. */
+
+static bool mpay_probe(mpay *_mpay) {
+    bool               r      = false;
+    struct curl_slist *h      = NULL;
+    struct mpay_buf    b      = {0};
+    char              *url    = NULL;
+    char              *body   = NULL;
+    str256             token;
+    long               terminal;
+    CURLcode           ce;
+    if (pthread_mutex_trylock(&_mpay->curl_lock)) {
+        /* A request is using the connection, it is warm. */
+        pthread_mutex_lock(&_mpay->warm_lock);
+        clock_gettime(CLOCK_MONOTONIC, &_mpay->warm_last);
+        pthread_mutex_unlock(&_mpay->warm_lock);
+        return true;
+    }
+    pthread_mutex_lock(&_mpay->warm_lock);
+    memcpy(token, _mpay->auth_api_token, sizeof(token));
+    terminal = _mpay->auth_terminal;
+    pthread_mutex_unlock(&_mpay->warm_lock);
+    h = mpay_headers(token);
+    if (!h/*err*/) goto cleanup;
+    if (asprintf(&url, "%s/v1/heartbeat", MPAY_URL)==-1/*err*/) { url = NULL; goto cleanup; }
+    if (asprintf(&body, "{\"terminal\": %li}", terminal)==-1/*err*/) { body = NULL; goto cleanup; }
+    mpay_curl_setup(_mpay, _mpay->curl, h, url, body, &b);
+    ce = curl_easy_perform(_mpay->curl);
+    if (ce != CURLE_OK/*err*/) {
+        syslog(LOG_WARNING, "Keep-alive: %s", curl_easy_strerror(ce));
+        goto cleanup;
+    }
+    r = true;
+ cleanup:
+    /* Requests set all the options again, not the freed headers. */
+    curl_easy_setopt(_mpay->curl, CURLOPT_HTTPHEADER, NULL);
+    pthread_mutex_unlock(&_mpay->curl_lock);
+    pthread_mutex_lock(&_mpay->warm_lock);
+    _mpay->stats.probes++;
+    if (!r) _mpay->stats.probe_errors++;
+    clock_gettime(CLOCK_MONOTONIC, &_mpay->warm_last);
+    pthread_mutex_unlock(&_mpay->warm_lock);
+    curl_slist_free_all(h);
+    free(url);
+    free(body);
+    free(b.d);
+    return r;
+}
+
+static void *mpay_warm_main(void *_udata) {
+    mpay            *m = _udata;
+    struct timespec  now, deadline;
+    pthread_mutex_lock(&m->warm_lock);
+    while (!m->warm_stop) {
+        if (m->warm_prewarm) {
+            m->warm_prewarm = false;
+            pthread_mutex_unlock(&m->warm_lock);
+            mpay_probe(m);
+            pthread_mutex_lock(&m->warm_lock);
+            continue;
+        }
+        if (m->warm_keepalive <= 0) {
+            pthread_cond_wait(&m->warm_cond, &m->warm_lock);
+            continue;
+        }
+        deadline = m->warm_last;
+        deadline.tv_sec += m->warm_keepalive;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec > deadline.tv_sec ||
+            (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec)) {
+            pthread_mutex_unlock(&m->warm_lock);
+            mpay_probe(m);
+            pthread_mutex_lock(&m->warm_lock);
+            continue;
+        }
+        pthread_cond_timedwait(&m->warm_cond, &m->warm_lock, &deadline);
+    }
+    pthread_mutex_unlock(&m->warm_lock);
+    return NULL;
+}
+
+static bool mpay_warm_start(mpay *_mpay) {
+    int e;
+    if (_mpay->warm_running) {
+        pthread_cond_signal(&_mpay->warm_cond);
+        return true;
+    }
+    e = pthread_create(&_mpay->warm_thread, NULL, mpay_warm_main, _mpay);
+    if (e/*err*/) {
+        syslog(LOG_ERR, "Can't start warm-up thread: %s", strerror(e));
+        return false;
+    }
+    _mpay->warm_running = true;
+    return true;
+}
+
+bool mpay_prewarm(mpay *_mpay) {
+    bool r;
+    if (!mpay_chk_auth(_mpay, NULL)/*err*/) return false;
+    if (_mpay->transport == MPAY_TRANSPORT_REPLAY ||
+        _mpay->transport == MPAY_TRANSPORT_REPLAY_TIMED) {
+        return true;
+    }
+    pthread_mutex_lock(&_mpay->warm_lock);
+    _mpay->warm_prewarm = true;
+    r = mpay_warm_start(_mpay);
+    pthread_mutex_unlock(&_mpay->warm_lock);
+    return r;
+}
+
+bool mpay_keepalive(mpay *_mpay, int _secs) {
+    bool r = true;
+    if (_secs > 0 && !mpay_chk_auth(_mpay, NULL)/*err*/) return false;
+    if (_mpay->transport == MPAY_TRANSPORT_REPLAY ||
+        _mpay->transport == MPAY_TRANSPORT_REPLAY_TIMED) {
+        return true;
+    }
+    pthread_mutex_lock(&_mpay->warm_lock);
+    if (_secs > 0 && _mpay->warm_keepalive <= 0) {
+        /* Count the first interval from now, not from the epoch. */
+        clock_gettime(CLOCK_MONOTONIC, &_mpay->warm_last);
+    }
+    _mpay->warm_keepalive = _secs;
+    if (_secs > 0) {
+        r = mpay_warm_start(_mpay);
+    } else {
+        pthread_cond_signal(&_mpay->warm_cond);
+    }
+    pthread_mutex_unlock(&_mpay->warm_lock);
+    return r;
+}
+
+bool mpay_create_env(mpay **_mpay) {
+    mpay       *m = NULL;
+    const char *s, *reason;
+    char       *end;
+    long        secs, slow_ms = 0;
+    double      sample = 1.0;
+    bool        e;
+    if ((s = getenv("PAYCOMET_URL"))) MPAY_URL = s;
+    if ((s = getenv("PAYCOMET_TRACE_SAMPLE"))) {
+        sample = strtod(s, &end);
+        if (end == s || *end || !(sample >= 0 && sample <= 1)/*err*/) goto cleanup_invalid_sample;
+    }
+    if ((s = getenv("PAYCOMET_TRACE_SLOW_MS"))) {
+        slow_ms = strtol(s, &end, 10);
+        if (end == s || *end || slow_ms < 0 || slow_ms > INT_MAX/*err*/) goto cleanup_invalid_slow;
+    }
+    if ((s = getenv("PAYCOMET_TRACE")) || (s = getenv("PAYCOMET_TRACE_OTLP"))) {
+        e = mpay_trace_start(s,
+                             (getenv("PAYCOMET_TRACE"))?MPAY_TRACE_CHROME:MPAY_TRACE_OTLP,
+                             sample, slow_ms);
+        if (!e/*err*/) return false;
+    }
+    e = mpay_create(&m);
+    if (!e/*err*/) return false;
+    mpay_set_auth(m,
+                  getenv("PAYCOMET_API_TOKEN"),
+                  getenv("PAYCOMET_TERMINAL"));
+    if ((s = getenv("PAYCOMET_RECORD"))) {
+        e = mpay_set_transport(m, MPAY_TRANSPORT_RECORD, s);
+        if (!e/*err*/) goto cleanup;
+    } else if ((s = getenv("PAYCOMET_REPLAY"))) {
+        e = mpay_set_transport(m, MPAY_TRANSPORT_REPLAY, s);
+        if (!e/*err*/) goto cleanup;
+    } else if ((s = getenv("PAYCOMET_REPLAY_TIMED"))) {
+        e = mpay_set_transport(m, MPAY_TRANSPORT_REPLAY_TIMED, s);
+        if (!e/*err*/) goto cleanup;
+    }
+    if ((s = getenv("PAYCOMET_CACHE"))) {
+        e = mpay_set_cache(m, (s[0])?s:MPAY_CACHE_DEFAULT);
+        if (!e/*err*/) goto cleanup;
+    }
+    if ((s = getenv("PAYCOMET_COMPRESS"))) {
+        e = mpay_set_compression(m, (strcmp(s, "no"))?s:NULL);
+        if (!e/*err*/) goto cleanup;
+    }
+    if (getenv("PAYCOMET_PREWARM") || getenv("PAYCOMET_KEEPALIVE")) {
+        e = mpay_chk_auth(m, &reason);
+        if (!e/*err*/) goto cleanup_auth;
+    }
+    if (getenv("PAYCOMET_PREWARM")) {
+        e = mpay_prewarm(m);
+        if (!e/*err*/) goto cleanup;
+    }
+    if ((s = getenv("PAYCOMET_KEEPALIVE"))) {
+        secs = strtol(s, &end, 10);
+        if (end == s || *end || secs <= 0 || secs > INT_MAX/*err*/) goto cleanup_invalid_keepalive;
+        e = mpay_keepalive(m, secs);
+        if (!e/*err*/) goto cleanup;
+    }
+    *_mpay = m;
+    return true;
+ cleanup_auth:
+    syslog(LOG_ERR, "%s", reason);
+    goto cleanup;
+ cleanup_invalid_keepalive:
+    syslog(LOG_ERR, "Invalid PAYCOMET_KEEPALIVE: %s", s);
+    goto cleanup;
+ cleanup_invalid_sample:
+    syslog(LOG_ERR, "Invalid PAYCOMET_TRACE_SAMPLE: %s", s);
+    return false;
+ cleanup_invalid_slow:
+    syslog(LOG_ERR, "Invalid PAYCOMET_TRACE_SLOW_MS: %s", s);
+    return false;
+ cleanup:
+    mpay_destroy(m);
+    return false;
+}
+
+void mpay_get_stats(mpay *_mpay, struct mpay_stats *_s) {
+    pthread_mutex_lock(&_mpay->warm_lock);
+    *_s = _mpay->stats;
+    pthread_mutex_unlock(&_mpay->warm_lock);
+}
+
+void mpay_print_stats(mpay *_mpay, FILE *_fp) {
+    struct mpay_stats s;
+    mpay_get_stats(_mpay, &s);
+    fprintf(_fp, "Requests          : %lu\n", s.requests);
+    fprintf(_fp, "Warm connections  : %lu\n", s.warm);
+    fprintf(_fp, "Cold connections  : %lu\n", s.cold);
+    fprintf(_fp, "Keep-alive probes : %lu (%lu failed)\n", s.probes, s.probe_errors);
+    fprintf(_fp, "Coalesced         : %lu\n", s.coalesced);
+    if (s.requests) {
+        fprintf(_fp, "DNS time (avg)    : %.3f ms\n", s.usec_dns/1000.0/s.requests);
+        fprintf(_fp, "Connect (avg)     : %.3f ms\n", s.usec_connect/1000.0/s.requests);
+        fprintf(_fp, "TLS time (avg)    : %.3f ms\n", s.usec_tls/1000.0/s.requests);
+        fprintf(_fp, "Total time (avg)  : %.3f ms\n", s.usec_total/1000.0/s.requests);
+    }
+    if (s.bytes_body) {
+        fprintf(_fp, "Response bytes    : %lu received, %lu decoded (%.1f%% saved)\n",
+                s.bytes_wire, s.bytes_body,
+                (s.bytes_body > s.bytes_wire)?100.0*(s.bytes_body-s.bytes_wire)/s.bytes_body:0.0);
+    }
+}
+
+/* ---- Tracing. ----
+ *
+ * Calls record a span with the time spent in each phase. Finished spans
+ * go to a ring shared by all threads without locks (a bounded queue where
+ * each cell has a sequence number) and are written to the trace file by
+ * mpay_trace_flush(), or by the thread that finds the ring half full.
+ * Spans are dropped when the ring is full. Failed calls, and those slower
+ * than `slow_ms`, are kept regardless of the sample rate. */
+
+#define MPAY_TRACE_RING 4096
+
+static const char *const mpay_phase_names[MPAY_PHASES] = {
+    "auth", "build", "acquire", "dns", "connect", "tls", "send", "wait", "receive", "decode"
+};
+
+struct mpay_trace_cell {
+    unsigned long    seq;
+    struct mpay_span span;
+};
+
+static struct {
+    pthread_mutex_t        lock;    /* Taken by flushes only. */
+    bool                   on;
+    bool                   ready;
+    FILE                  *fp;
+    enum mpay_trace_format format;
+    double                 sample;
+    long                   slow_us;
+    unsigned long          head;
+    unsigned long          tail;
+    unsigned long          dropped;
+    unsigned long          tids;
+    struct mpay_trace_cell ring[MPAY_TRACE_RING];
+} mpay_tracer = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static __thread unsigned long mpay_trace_rnd;
+static __thread unsigned long mpay_trace_tid;
+
+static unsigned long mpay_trace_random(void) {
+    unsigned long x = mpay_trace_rnd;
+    if (!x) {
+        struct timespec t;
+        clock_gettime(CLOCK_REALTIME, &t);
+        x = ((unsigned long)t.tv_sec<<32) ^ t.tv_nsec ^ (unsigned long)&t;
+        if (!x) x = 1;
+    }
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    mpay_trace_rnd = x;
+    return x * 0x2545F4914F6CDD1DUL;
+}
+
+static void mpay_trace_begin(struct mpay_trace *_t, const char *_name, const char *_order) {
+    struct timespec now;
+    _t->on = __atomic_load_n(&mpay_tracer.on, __ATOMIC_ACQUIRE);
+    if (!_t->on) return;
+    if (!mpay_trace_tid) {
+        mpay_trace_tid = __atomic_add_fetch(&mpay_tracer.tids, 1, __ATOMIC_RELAXED);
+    }
+    memset(&_t->span, 0, sizeof(_t->span));
+    _t->span.name  = _name;
+    _t->span.tid   = mpay_trace_tid;
+    _t->span.id[0] = mpay_trace_random();
+    _t->span.id[1] = mpay_trace_random();
+    if (_order) {
+        strncpy(_t->span.order, _order, sizeof(_t->span.order)-1);
+    }
+    _t->sampled = (mpay_trace_random()>>11)/9007199254740992.0 < mpay_tracer.sample;
+    clock_gettime(CLOCK_REALTIME, &now);
+    _t->span.start_us = now.tv_sec*1000000UL + now.tv_nsec/1000;
+    clock_gettime(CLOCK_MONOTONIC, &_t->t0);
+    _t->tl = _t->t0;
+}
+
+static unsigned long mpay_trace_since(struct timespec *_t1, struct timespec *_t2) {
+    return (_t2->tv_sec-_t1->tv_sec)*1000000+(_t2->tv_nsec-_t1->tv_nsec)/1000;
+}
+
+static void mpay_trace_mark(struct mpay_trace *_t, enum mpay_phase _p) {
+    struct timespec now;
+    if (!_t->on) return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (!_t->span.phase_us[_p]) {
+        _t->span.phase_at[_p] = mpay_trace_since(&_t->t0, &_t->tl);
+    }
+    _t->span.phase_us[_p] += mpay_trace_since(&_t->tl, &now);
+    _t->tl = now;
+}
+
+/* The transfer phases come from libcurl's timings, counted from the
+ * last mark. The time the caller took to notice the end is not in any. */
+static void mpay_trace_curl(struct mpay_trace *_t, CURL *_curl, bool _failed) {
+    curl_off_t       dns = 0, con = 0, tls = 0, post = 0, start = 0, total = 0;
+    unsigned int    *ph  = _t->span.phase_us;
+    unsigned int    *at  = _t->span.phase_at;
+    unsigned long    base;
+    if (!_t->on) return;
+    base = mpay_trace_since(&_t->t0, &_t->tl);
+    clock_gettime(CLOCK_MONOTONIC, &_t->tl);
+    curl_easy_getinfo(_curl, CURLINFO_NAMELOOKUP_TIME_T   , &dns);
+    curl_easy_getinfo(_curl, CURLINFO_CONNECT_TIME_T      , &con);
+    curl_easy_getinfo(_curl, CURLINFO_APPCONNECT_TIME_T   , &tls);
+#if LIBCURL_VERSION_NUM >= 0x080a00
+    curl_easy_getinfo(_curl, CURLINFO_POSTTRANSFER_TIME_T , &post);
+#else
+    curl_easy_getinfo(_curl, CURLINFO_PRETRANSFER_TIME_T  , &post);
+#endif
+    curl_easy_getinfo(_curl, CURLINFO_STARTTRANSFER_TIME_T, &start);
+    curl_easy_getinfo(_curl, CURLINFO_TOTAL_TIME_T        , &total);
+    if (_failed) {
+        /* The transfer stopped in the first phase it did not end. */
+        if (!dns)   dns   = total;
+        if (!con)   con   = total;
+        if (!post)  post  = total;
+        if (!start) start = total;
+    }
+    if (con   < dns)   con   = dns;
+    if (tls   < con)   tls   = con;
+    if (post  < tls)   post  = tls;
+    if (start < post)  start = post;
+    if (total < start) total = start;
+    at[MPAY_PHASE_DNS]     = base;       ph[MPAY_PHASE_DNS]     = dns;
+    at[MPAY_PHASE_CONNECT] = base+dns;   ph[MPAY_PHASE_CONNECT] = con-dns;
+    at[MPAY_PHASE_TLS]     = base+con;   ph[MPAY_PHASE_TLS]     = tls-con;
+    at[MPAY_PHASE_SEND]    = base+tls;   ph[MPAY_PHASE_SEND]    = post-tls;
+    at[MPAY_PHASE_WAIT]    = base+post;  ph[MPAY_PHASE_WAIT]    = start-post;
+    at[MPAY_PHASE_RECEIVE] = base+start; ph[MPAY_PHASE_RECEIVE] = total-start;
+}
+
+static bool mpay_trace_pop(struct mpay_span *_s) {
+    unsigned long           pos = mpay_tracer.tail;
+    struct mpay_trace_cell *c   = &mpay_tracer.ring[pos & (MPAY_TRACE_RING-1)];
+    if (__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) != pos+1) return false;
+    *_s = c->span;
+    __atomic_store_n(&c->seq, pos+MPAY_TRACE_RING, __ATOMIC_RELEASE);
+    __atomic_store_n(&mpay_tracer.tail, pos+1, __ATOMIC_RELAXED);
+    return true;
+}
+
+static void mpay_trace_push(struct mpay_span *_s) {
+    unsigned long           pos = __atomic_load_n(&mpay_tracer.head, __ATOMIC_RELAXED);
+    struct mpay_trace_cell *c;
+    long                    dif;
+    for (;;) {
+        c   = &mpay_tracer.ring[pos & (MPAY_TRACE_RING-1)];
+        dif = (long)(__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) - pos);
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&mpay_tracer.head, &pos, pos+1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+        } else if (dif < 0) {
+            __atomic_add_fetch(&mpay_tracer.dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&mpay_tracer.head, __ATOMIC_RELAXED);
+        }
+    }
+    c->span = *_s;
+    __atomic_store_n(&c->seq, pos+1, __ATOMIC_RELEASE);
+}
+
+static void mpay_trace_fputs_json(FILE *_fp, const char *_s) {
+    fputc('"', _fp);
+    for (; *_s; _s++) {
+        if (*_s == '"' || *_s == '\\') {
+            fprintf(_fp, "\\%c", *_s);
+        } else if ((unsigned char)*_s < 0x20) {
+            fprintf(_fp, "\\u%04x", *_s);
+        } else {
+            fputc(*_s, _fp);
+        }
+    }
+    fputc('"', _fp);
+}
+
+static void mpay_trace_write_chrome(FILE *_fp, struct mpay_span *_s) {
+    unsigned long ts  = _s->start_us;
+    int           pid = getpid();
+    fprintf(_fp, "{\"name\":\"%s\",\"cat\":\"mpay\",\"ph\":\"X\",\"ts\":%lu,\"dur\":%lu,"
+            "\"pid\":%i,\"tid\":%lu,\"args\":{\"order\":",
+            _s->name, ts, _s->dur_us, pid, _s->tid);
+    mpay_trace_fputs_json(_fp, _s->order);
+    fprintf(_fp, ",\"http\":%li,\"errorCode\":%li,\"error\":%i,\"ok\":%s,\"coalesced\":%s}},\n",
+            _s->rcode, _s->error_code, _s->error,
+            (_s->ok)?"true":"false", (_s->coalesced)?"true":"false");
+    for (int p=0; p<MPAY_PHASES; p++) {
+        if (_s->phase_us[p]) {
+            fprintf(_fp, "{\"name\":\"%s\",\"cat\":\"mpay\",\"ph\":\"X\",\"ts\":%lu,\"dur\":%u,"
+                    "\"pid\":%i,\"tid\":%lu},\n",
+                    mpay_phase_names[p], ts+_s->phase_at[p], _s->phase_us[p], pid, _s->tid);
+        }
+    }
+}
+
+static void mpay_trace_write_otlp(FILE *_fp, struct mpay_span *_s, bool _first) {
+    unsigned long ts = _s->start_us;
+    fprintf(_fp, "%s{\"traceId\":\"%016lx%016lx\",\"spanId\":\"%016lx\",\"name\":\"%s\",\"kind\":3,"
+            "\"startTimeUnixNano\":\"%lu000\",\"endTimeUnixNano\":\"%lu000\",\"attributes\":["
+            "{\"key\":\"paycomet.order\",\"value\":{\"stringValue\":",
+            (_first)?"":",", _s->id[0], _s->id[1], _s->id[1], _s->name, ts, ts+_s->dur_us);
+    mpay_trace_fputs_json(_fp, _s->order);
+    fprintf(_fp, "}},{\"key\":\"http.response.status_code\",\"value\":{\"intValue\":\"%li\"}},"
+            "{\"key\":\"paycomet.error_code\",\"value\":{\"intValue\":\"%li\"}},"
+            "{\"key\":\"paycomet.coalesced\",\"value\":{\"boolValue\":%s}}],"
+            "\"status\":{\"code\":%i}}",
+            _s->rcode, _s->error_code, (_s->coalesced)?"true":"false", (_s->ok)?1:2);
+    for (int p=0; p<MPAY_PHASES; p++) {
+        if (_s->phase_us[p]) {
+            fprintf(_fp, ",{\"traceId\":\"%016lx%016lx\",\"spanId\":\"%016lx\",\"parentSpanId\":\"%016lx\","
+                    "\"name\":\"%s\",\"kind\":1,\"startTimeUnixNano\":\"%lu000\",\"endTimeUnixNano\":\"%lu000\"}",
+                    _s->id[0], _s->id[1], _s->id[1]+p+1, _s->id[1], mpay_phase_names[p],
+                    ts+_s->phase_at[p], ts+_s->phase_at[p]+_s->phase_us[p]);
+        }
+    }
+}
+
+/* Called with the lock taken. */
+static bool mpay_trace_drain(void) {
+    struct mpay_span s;
+    bool             first = true;
+    if (!mpay_tracer.fp) return true;
+    while (mpay_trace_pop(&s)) {
+        if (mpay_tracer.format == MPAY_TRACE_OTLP) {
+            if (first) {
+                fputs("{\"resourceSpans\":[{\"resource\":{\"attributes\":[{\"key\":\"service.name\","
+                      "\"value\":{\"stringValue\":\"mpaycomet\"}}]},\"scopeSpans\":[{\"scope\":"
+                      "{\"name\":\"c-mpaycomet\"},\"spans\":[", mpay_tracer.fp);
+            }
+            mpay_trace_write_otlp(mpay_tracer.fp, &s, first);
+        } else {
+            mpay_trace_write_chrome(mpay_tracer.fp, &s);
+        }
+        first = false;
+    }
+    if (!first && mpay_tracer.format == MPAY_TRACE_OTLP) {
+        fputs("]}]}]}\n", mpay_tracer.fp);
+    }
+    if (fflush(mpay_tracer.fp) == EOF/*err*/) {
+        syslog(LOG_ERR, "Can't write trace: %s", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+static void mpay_trace_end(struct mpay_trace *_t, json_t *_j, long _rcode, bool _ok, enum mpay_error _error) {
+    unsigned long depth;
+    if (!_t->on) return;
+    mpay_trace_mark(_t, MPAY_PHASE_DECODE);
+    _t->on = false;
+    _t->span.dur_us     = mpay_trace_since(&_t->t0, &_t->tl);
+    _t->span.rcode      = _rcode;
+    _t->span.error_code = (_j)?json_object_get_integer(_j, "errorCode"):0;
+    _t->span.error      = _error;
+    _t->span.ok         = _ok && _rcode < 400 && !_t->span.error_code;
+    if (!_t->sampled && _t->span.ok &&
+        (mpay_tracer.slow_us <= 0 || _t->span.dur_us < (unsigned long)mpay_tracer.slow_us)) {
+        return;
+    }
+    mpay_trace_push(&_t->span);
+    depth = __atomic_load_n(&mpay_tracer.head, __ATOMIC_RELAXED) -
+            __atomic_load_n(&mpay_tracer.tail, __ATOMIC_RELAXED);
+    if (depth >= MPAY_TRACE_RING/2 && pthread_mutex_trylock(&mpay_tracer.lock) == 0) {
+        mpay_trace_drain();
+        pthread_mutex_unlock(&mpay_tracer.lock);
+    }
+}
+
+bool mpay_trace_start(const char *_file, enum mpay_trace_format _format, double _sample, long _slow_ms) {
+    FILE             *fp;
+    struct mpay_span  s;
+    fp = fopen(_file, "a");
+    if (!fp/*err*/) {
+        syslog(LOG_ERR, "%s: %s", _file, strerror(errno));
+        return false;
+    }
+    mpay_trace_stop();
+    pthread_mutex_lock(&mpay_tracer.lock);
+    if (!mpay_tracer.ready) {
+        for (unsigned long i=0; i<MPAY_TRACE_RING; i++) {
+            mpay_tracer.ring[i].seq = i;
+        }
+        mpay_tracer.ready = true;
+    }
+    while (mpay_trace_pop(&s)) {}
+    /* Append mode leaves the position at 0 until the first write. */
+    if (_format == MPAY_TRACE_CHROME && fseek(fp, 0, SEEK_END) == 0 && ftell(fp) == 0) {
+        /* The closing bracket is optional in the trace event format. */
+        fputs("[\n", fp);
+    }
+    mpay_tracer.fp      = fp;
+    mpay_tracer.format  = _format;
+    mpay_tracer.sample  = _sample;
+    mpay_tracer.slow_us = _slow_ms*1000;
+    __atomic_store_n(&mpay_tracer.on, true, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&mpay_tracer.lock);
+    return true;
+}
+
+bool mpay_trace_flush(void) {
+    bool r;
+    pthread_mutex_lock(&mpay_tracer.lock);
+    r = mpay_trace_drain();
+    pthread_mutex_unlock(&mpay_tracer.lock);
+    return r;
+}
+
+void mpay_trace_stop(void) {
+    unsigned long dropped;
+    pthread_mutex_lock(&mpay_tracer.lock);
+    __atomic_store_n(&mpay_tracer.on, false, __ATOMIC_RELEASE);
+    if (mpay_tracer.fp) {
+        mpay_trace_drain();
+        fclose(mpay_tracer.fp);
+        mpay_tracer.fp = NULL;
+    }
+    dropped = __atomic_exchange_n(&mpay_tracer.dropped, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&mpay_tracer.lock);
+    if (dropped) {
+        syslog(LOG_WARNING, "Trace: %lu spans dropped, the ring was full.", dropped);
+    }
+}
+
+static bool mpay_heartbeat_parse(json_t *_j, crest_result *_hr, FILE *_fp1) {
+    const char *ping_paycomet      = json_object_get_string (_j, "time");
+    const char *ping_processor     = json_object_get_string (_j, "processorTime");
+    if (!ping_paycomet || !ping_processor/*err*/) {
+        syslog(LOG_ERR, "Received invalid response:\n%.*s", (int)_hr->dsz, _hr->d);
+        return false;
+    }
+    if (_fp1) {
+        fprintf(_fp1, "Paycomet ping     : %s\n", ping_paycomet);
+        fprintf(_fp1, "Processor ping    : %s\n", ping_processor);
+    }
+    return true;
+}
+
+bool mpay_heartbeat(mpay *_mpay, FILE *_fp1) {
+    bool           retval          = false;
+    crest_result   hr              = {0};
+    char          *body            = NULL;
+    json_t        *j1              = NULL;
+    int            e;
+    mpay_trace_begin(&_mpay->trace, __func__, NULL);
     e = mpay_chk_auth(_mpay, NULL);
-    if (!e/*err*/) goto cleanup_unauthorized;
-    e = crest_start_url(_mpay->crest, "%s/v1/payments/%s/refund", MPAY_URL, _order);
     if (!e/*err*/) goto cleanup;
-    e = crest_post_data(_mpay->crest, CREST_CONTENT_TYPE_JSON, &fp);
+    e = asprintf(&body, "{\"terminal\": %li}", _mpay->auth_terminal);
+    if (e<0/*err*/) { body = NULL; goto cleanup_errno; }
+    e = mpay_perform(_mpay, &hr, body, "%s/v1/heartbeat", MPAY_URL);
     if (!e/*err*/) goto cleanup;
-    e = json_dumpf(req, fp, JSON_INDENT(4));
-    if (e<0/*err*/) goto cleanup_errno;
-    e = crest_perform(_mpay->crest, &hr.ctype, &hr.rcode, &hr.d, &hr.dsz);
+    e = crest_get_json(&j1, hr.ctype, hr.rcode, hr.d, hr.dsz);
     if (!e/*err*/) goto cleanup;
-    e = crest_get_json(&j, hr.ctype, hr.rcode, hr.d, hr.dsz);
+    retval = mpay_heartbeat_parse(j1, &hr, _fp1);
+ cleanup:
+    mpay_trace_end(&_mpay->trace, j1, hr.rcode, retval, _mpay->error);
+    if (j1) json_decref(j1);
+    free(body);
+    return retval;
+ cleanup_errno:
+    syslog(LOG_ERR, "%s", strerror(errno));
+    goto cleanup;
+}
+
+bool mpay_methods_get(mpay *_mpay, json_t **_r) {
+    crest_result   hr              = {0};
+    bool           retval          = false;
+    char          *body            = NULL;
+    json_t        *j1              = NULL;
+    int            e;
+    mpay_trace_begin(&_mpay->trace, __func__, NULL);
+    e = mpay_chk_auth(_mpay, NULL);
     if (!e/*err*/) goto cleanup;
-    if (_opt_result) {
-        *_opt_result = json_incref(j);
+    e = asprintf(&body, "{\"terminal\": %li}", _mpay->auth_terminal);
+    if (e<0/*err*/) { body = NULL; goto cleanup_errno; }
+    e = mpay_perform(_mpay, &hr, body, "%s/v1/methods", MPAY_URL);
+    if (!e/*err*/) goto cleanup;
+    e = crest_get_json(&j1, hr.ctype, hr.rcode, hr.d, hr.dsz);
+    if (!e/*err*/) goto cleanup;
+    if (_r) {
+        *_r = json_incref(j1);
     }
-    ret = true;
-    goto cleanup;
+    retval = true;
+ cleanup:
+    mpay_trace_end(&_mpay->trace, j1, hr.rcode, retval, _mpay->error);
+    if (j1) json_decref(j1);
+    free(body);
+    return retval;
  cleanup_errno:
     syslog(LOG_ERR, "%s", strerror(errno));
     goto cleanup;
- cleanup_unauthorized:
-    syslog(LOG_ERR, "Not configured.");
-    goto cleanup;
+}
+
+static char *mpay_exchange_body(mpay *_mpay, coin_t _fr, coin_t *_to, const char *_currency) {
+    char *body;
+    int   e;
+    strncpy(_to->currency, _currency, sizeof(_to->currency)-1);
+    for (char *c=_fr.currency; *c; c++)  *c=toupper(*c);
+    for (char *c=_to->currency; *c; c++) *c=toupper(*c);
+    e = asprintf(&body,
+                "{"
+                "    \"terminal\"        : %li, "   "\n"
+                "    \"amount\"          : %li,"    "\n"
+                "    \"originalCurrency\": \"%s\"," "\n"
+                "    \"finalCurrency\"   : \"%s\""  "\n"
+                "}"                                 "\n",
+                _mpay->auth_terminal,
+                _fr.cents,
+                _fr.currency,
+                _to->currency);
+    if (e<0/*err*/) {
+        syslog(LOG_ERR, "%s", strerror(errno));
+        return NULL;
+    }
+    return body;
+}
+
+static bool mpay_exchange_parse(json_t *_j, crest_result *_hr, coin_t *_to) {
+    json_t *j2 = json_object_get(_j, "amount");
+    if (!j2 || !json_is_number(j2)/*err*/) {
+        syslog(LOG_ERR, "Invalid response from paycomet: %.*s", (int)_hr->dsz, _hr->d);
+        return false;
+    }
+    _to->cents = json_number_value(j2);
+    return true;
+}
+
+bool mpay_exchange(mpay *_mpay, coin_t _fr, coin_t *_to, const char *_currency) {
+    
+    bool           r               = false;
+    crest_result   hr              = {0};
+    char          *body            = NULL;
+    json_t        *resp_j          = NULL;
+    int            e;
+    
+    mpay_trace_begin(&_mpay->trace, __func__, NULL);
+    e = mpay_chk_auth(_mpay, NULL);
+    if (!e/*err*/) goto cleanup;
+    body = mpay_exchange_body(_mpay, _fr, _to, _currency);
+    if (!body/*err*/) goto cleanup;
+    e = mpay_perform_shared(_mpay, &hr, body, "%s/v1/exchange", MPAY_URL);
+    if (!e/*err*/) goto cleanup;
+    e = crest_get_json(&resp_j, hr.ctype, hr.rcode, hr.d, hr.dsz);
+    if (!e/*err*/) goto cleanup;
+    r = mpay_exchange_parse(resp_j, &hr, _to);
  cleanup:
-    if (j) json_decref(j);
-    return ret;
+    mpay_trace_end(&_mpay->trace, resp_j, hr.rcode, r, _mpay->error);
+    if (resp_j) json_decref(resp_j);
+    free(body);
+    return r;
+}
+
+bool mpay_form_prepare(struct mpay_form *_f, enum mpay_operationType type, char *_opts[]) {
+    
+    char         **opt;
+    char         **dst_s;
+    int           *dst_i;
+    time_t        *dst_t;
+    long           l;
+    int            e;
+
+    _f->operationType = type;
+    _f->payment.methods[0] = MPAY_METHOD_CARD;
+    for (opt = _opts; _opts && *opt; opt+=2) {
+        if (!strcasecmp(*opt, "amount")) {
+            e = coin_parse(&_f->payment.amount, *(opt+1), NULL);
+            if (!e/*err*/) return false;
+        } else if ((dst_s = str2ptr
+                    (*opt, strcasecmp,
+                     "language"           , &_f->language,
+                     "description"        , &_f->productDescription,
+                     "productDescription" , &_f->productDescription,
+                     "merchantDescription", &_f->payment.merchantDescription,
+                     "order"              , &_f->payment.order,
+                     "tokenUser"          , &_f->payment.tokenUser,
+                     "originalIp"         , &_f->payment.originalIp,
+                     "scoring"            , &_f->payment.scoring,
+                     "url_success"        , &_f->payment.urlOk,
+                     "urlOk"              , &_f->payment.urlOk,
+                     "url_cancel"         , &_f->payment.urlKo,
+                     "urlKo"              , &_f->payment.urlKo,
+                     NULL))) {
+            *dst_s = *(opt+1);
+        } else if ((dst_i = str2ptr
+                    (*opt, strcasecmp,
+                     "idUser"         , &_f->payment.idUser,
+                     "secure"         , &_f->payment.secure,
+                     "userInteraction", &_f->payment.userInteraction,
+                     "periodicity"    , &_f->subscription.periodicity,
+                     NULL))) {
+            e = long_parse(&l, *(opt+1), NULL);
+            if (!e/*err*/) return false;
+            *dst_i = l;
+        } else if ((dst_t = str2ptr
+                    (*opt, strcasecmp,
+                     "date_start", &_f->subscription.start_date,
+                     "date_end"  , &_f->subscription.end_date,
+                     NULL))) {
+            e = time_day_parse(dst_t, *(opt+1), NULL);
+            if (!e/*err*/) return false;
+        }
+        
+    }
+    return true;
+}
+
+json_t *mpay_form_to_json(mpay *_mpay, struct mpay_form *_f) {
+    json_t *body = NULL;
+    if (_f->operationType==MPAY_FORM_INVALID) {
+        syslog(LOG_ERR, "mpay_form: Missing operationType.");
+        return NULL;
+    } else if (_f->operationType == MPAY_FORM_TOKENIZATION) {
+
+    } else {
+        if (!_f->payment.amount.cents || !_f->payment.amount.currency[0]) {
+            syslog(LOG_ERR, "Missing parameter: `amount=100eur`.");
+            return NULL;
+        }
+        if (!_f->payment.order) {
+            syslog(LOG_ERR, "Missing parameter: `order=REF`.");
+            return NULL;
+        }
+    }
+        
+    body = json_object();
+    json_object_set_integer(body, "operationType", _f->operationType);
+    if (_f->language) {
+        json_object_set_string(body, "language", _f->language);
+    }
+    json_object_set_integer(body, "terminal", _mpay->auth_terminal);
+    if (_f->operationType == MPAY_FORM_TOKENIZATION) {
+        if (_f->productDescription) {
+            json_object_set_string(body, "productDescription", _f->productDescription);
+        }
+    } else {
+        json_t *payment = json_object(); long_ss l_ss;
+        json_object_set_integer(payment, "terminal", _mpay->auth_terminal);
+        if (_f->payment.methods[0]) {
+            json_object_set(payment, "methods", __extension__ ({
+                        json_t *m  = json_array();
+                        for (int i=0; i<10 && _f->payment.methods[i]; i++) {
+                            json_array_append(m, json_integer(_f->payment.methods[i]));
+                        }
+                        m;
+                    }));
+        }
+        if (_f->payment.excludedMethods[0]) {
+            json_object_set(payment, "excludedMethods", __extension__ ({
+                        json_t *m = json_array();
+                        for (int i=0; i<10 && _f->payment.excludedMethods[i]; i++) {
+                            json_array_append(m, json_integer(_f->payment.excludedMethods[i]));
+                        }
+                        m;
+                    }));
+        }
+        if (_f->payment.order) {
+            json_object_set_string(payment, "order", _f->payment.order);
+        }
+        json_object_set_string(payment, "amount", ulong_str(_f->payment.amount.cents, &l_ss));
+        json_object_set_string(payment, "currency", __extension__ ({
+                    for (char *c=_f->payment.amount.currency; *c; c++) {
+                        *c = toupper(*c);
+                    }
+                    _f->payment.amount.currency;
+                }));
+        if (_f->payment.idUser>0) {
+            json_object_set_integer(payment, "idUser", _f->payment.idUser);
+        }
+        if (_f->payment.tokenUser) {
+            json_object_set_string(payment, "tokenUser", _f->payment.tokenUser);
+        }
+        json_object_set_integer(payment, "secure", _f->payment.secure);
+        if (_f->payment.scoring) {
+            json_object_set_string(payment, "scoring", _f->payment.scoring);
+        }
+        if (_f->productDescription) {
+            json_object_set_string(payment, "productDescription", _f->productDescription);
+        }
+        if (_f->payment.merchantDescription) {
+            json_object_set_string(payment, "merchantDescription", _f->payment.merchantDescription);
+        }
+        json_object_set_integer(payment, "userInteraction", _f->payment.userInteraction);
+        if (_f->payment.urlOk) {
+            json_object_set_string(payment, "urlOk", _f->payment.urlOk);
+        }
+        if (_f->payment.urlKo) {
+            json_object_set_string(payment, "urlKo", _f->payment.urlKo);
+        }
+        json_object_set(body, "payment", payment);
+    }
+    if (_f->operationType == MPAY_FORM_SUBSCRIPTION) {
+        json_t        *subscription_j  = json_object();
+        struct tm      tm              = {0};
+        char           txt[20]         = {0};
+        time_t         date_start      = 0;
+        time_t         date_end        = 0;
+        int            periodicity     = 0;
+        
+        if (_f->subscription.start_date) {
+            date_start = _f->subscription.start_date;
+        } else {
+            date_start = time(NULL);
+        }
+
+        if (_f->subscription.end_date) {
+            date_end = _f->subscription.end_date;
+        } else {
+            date_end = time(NULL)+(3600*24*364*5);
+        }
+
+        if (_f->subscription.periodicity) {
+            periodicity = _f->subscription.periodicity;
+        } else {
+            periodicity = 30;
+        }
+    
+        localtime_r(&date_start, &tm);
+        snprintf(txt, sizeof(txt)-1, "%04i%02i%02i", tm.tm_year+1900, tm.tm_mon+1, tm.tm_mday);
+        json_object_set_string(subscription_j, "startDate", txt);
+        
+        localtime_r(&date_end, &tm);
+        snprintf(txt, sizeof(txt)-1, "%04i%02i%02i", tm.tm_year+1900, tm.tm_mon+1, tm.tm_mday);
+        json_object_set_string(subscription_j, "endDate", txt);
+
+        snprintf(txt, sizeof(txt)-1, "%i", periodicity);
+        json_object_set_string(subscription_j, "periodicity", txt);
+
+        json_object_set(body, "subscription", subscription_j);
+    }
+        
+
+        
+        
+    
+    return body;
+}
+
+static bool mpay_form_parse(json_t *_j, crest_result *_rh, char **_url_m) {
+    const char *url;
+
+    /* Get URL. */
+    url = json_object_get_string(_j, "challengeUrl");
+    if (!url/*err*/) {
+        syslog(LOG_ERR, "Invalid response:\n%.*s", (int)_rh->dsz, _rh->d);
+        return false;
+    }
+    if (_url_m) {
+        *_url_m = strdup(url);
+        if (!*_url_m/*err*/) {
+            syslog(LOG_ERR, "%s", strerror(errno));
+            return false;
+        }
+    }
+    return true;
+}
+
+bool mpay_form(mpay *_mpay, struct mpay_form *_form, char **_url_m) {
+    
+    json_t        *req             = NULL;
+    bool           retval          = false;
+    char          *body            = NULL;
+    crest_result   rh              = {0};
+    json_t        *response        = NULL;
+    int            e;
+
+    /* Check _mpay has the credentials. */
+    mpay_trace_begin(&_mpay->trace, __func__, _form->payment.order);
+    e = mpay_chk_auth(_mpay, NULL);
+    if (!e/*err*/) goto cleanup;
+
+    /* Convert C struct to Json. */
+    req = mpay_form_to_json(_mpay, _form);
+    if (!req/*err*/) goto cleanup;
+
+    /* Set the request body. */
+    body = json_dumps(req, JSON_INDENT(4));
+    if (!body/*err*/) goto c_errno;
+
+    /* Perform the request and get response. */
+    e = mpay_perform(_mpay, &rh, body, "%s/v1/form", MPAY_URL);
+    if (!e/*err*/) goto cleanup;
+    e = crest_get_json(&response, rh.ctype, rh.rcode, rh.d, rh.dsz);
+    if (!e/*err*/) goto cleanup;
+    retval = mpay_form_parse(response, &rh, _url_m);
+ cleanup:
+    mpay_trace_end(&_mpay->trace, response, rh.rcode, retval, _mpay->error);
+    json_decref(response);
+    json_decref(req);
+    free(body);
+    return retval;
+ c_errno:
+    syslog(LOG_ERR, "%s", strerror(errno));
+    goto cleanup;
+}
+
+json_t *mpay_form_to_purchase(mpay *_mpay, struct mpay_form *_f) {
+    json_t  *body,*payment;
+    long_ss  l_ss;
+    if (!_f->payment.amount.cents || !_f->payment.amount.currency[0]) {
+        syslog(LOG_ERR, "Missing parameter: `amount=100eur`.");
+        return NULL;
+    }
+    if (!_f->payment.order) {
+        syslog(LOG_ERR, "Missing parameter: `order=REF`.");
+        return NULL;
+    }
+    if (_f->payment.idUser<=0 || !_f->payment.tokenUser) {
+        syslog(LOG_ERR, "Missing parameters: `idUser=ID tokenUser=TOKEN`.");
+        return NULL;
+    }
+    if (!_f->payment.originalIp) {
+        syslog(LOG_ERR, "Missing parameter: `originalIp=IP`.");
+        return NULL;
+    }
+    body    = json_object();
+    payment = json_object();
+    json_object_set_integer(payment, "terminal", _mpay->auth_terminal);
+    json_object_set_string(payment, "order", _f->payment.order);
+    json_object_set_string(payment, "amount", ulong_str(_f->payment.amount.cents, &l_ss));
+    json_object_set_string(payment, "currency", __extension__ ({
+                for (char *c=_f->payment.amount.currency; *c; c++) {
+                    *c = toupper(*c);
+                }
+                _f->payment.amount.currency;
+            }));
+    json_object_set_integer(payment, "methodId", (_f->payment.methods[0])?_f->payment.methods[0]:MPAY_METHOD_CARD);
+    json_object_set_string(payment, "originalIp", _f->payment.originalIp);
+    json_object_set_integer(payment, "idUser", _f->payment.idUser);
+    json_object_set_string(payment, "tokenUser", _f->payment.tokenUser);
+    json_object_set_integer(payment, "secure", _f->payment.secure);
+    if (_f->payment.scoring) {
+        json_object_set_string(payment, "scoring", _f->payment.scoring);
+    }
+    if (_f->productDescription) {
+        json_object_set_string(payment, "productDescription", _f->productDescription);
+    }
+    if (_f->payment.merchantDescription) {
+        json_object_set_string(payment, "merchantDescription", _f->payment.merchantDescription);
+    }
+    json_object_set_integer(payment, "userInteraction", _f->payment.userInteraction);
+    if (_f->payment.urlOk) {
+        json_object_set_string(payment, "urlOk", _f->payment.urlOk);
+    }
+    if (_f->payment.urlKo) {
+        json_object_set_string(payment, "urlKo", _f->payment.urlKo);
+    }
+    json_object_set(body, "payment", payment);
+    return body;
+}
+
+static bool mpay_purchase_parse(json_t                  *_j,
+                                crest_result            *_rh,
+                                enum mpay_payment_state *_opt_state,
+                                char                   **_opt_url_m) {
+    json_t     *j_err = json_object_get(_j, "errorCode");
+    const char *url;
+    if (j_err && !json_is_integer(j_err)/*err*/) {
+        syslog(LOG_ERR, "Invalid response:\n%.*s", (int)_rh->dsz, _rh->d);
+        return false;
+    }
+
+    /* A challenge URL means the bank asks for SCA (3DS). */
+    url = json_object_get_string(_j, "challengeUrl");
+    if (url && !url[0]) url = NULL;
+    if (_opt_state) {
+        if (j_err && json_integer_value(j_err) != 0) {
+            *_opt_state = MPAY_PAYMENT_FAILED;
+        } else if (url) {
+            *_opt_state = MPAY_PAYMENT_UNFINISHED;
+        } else {
+            *_opt_state = MPAY_PAYMENT_CORRECT;
+        }
+    }
+    if (_opt_url_m) {
+        *_opt_url_m = NULL;
+        if (url && !(*_opt_url_m = strdup(url))/*err*/) {
+            syslog(LOG_ERR, "%s", strerror(errno));
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool mpay_purchase(mpay                    *_mpay,
+                          const char              *_endpoint,
+                          struct mpay_form        *_form,
+                          enum mpay_payment_state *_opt_state,
+                          char                   **_opt_url_m,
+                          json_t                 **_opt_result) {
+    json_t        *req             = NULL;
+    bool           retval          = false;
+    char          *body            = NULL;
+    crest_result   rh              = {0};
+    json_t        *response        = NULL;
+    int            e;
+
+    /* Check _mpay has the credentials. */
+    e = mpay_chk_auth(_mpay, NULL);
+    if (!e/*err*/) goto cleanup;
+
+    /* Convert C struct to Json. */
+    req = mpay_form_to_purchase(_mpay, _form);
+    if (!req/*err*/) goto cleanup;
+    body = json_dumps(req, JSON_INDENT(4));
+    if (!body/*err*/) goto c_errno;
+
+    /* Perform the request and get response. */
+    e = mpay_perform(_mpay, &rh, body, "%s%s", MPAY_URL, _endpoint);
+    if (!e/*err*/) goto cleanup;
+    e = crest_get_json(&response, rh.ctype, rh.rcode, rh.d, rh.dsz);
+    if (!e/*err*/) goto cleanup;
+    e = mpay_purchase_parse(response, &rh, _opt_state, _opt_url_m);
+    if (!e/*err*/) goto cleanup;
+    if (_opt_result) {
+        *_opt_result = json_incref(response);
+    }
+
+    /* Returns. */
+    retval = true;
+ cleanup:
+    mpay_trace_end(&_mpay->trace, response, rh.rcode, retval, _mpay->error);
+    json_decref(response);
+    json_decref(req);
+    free(body);
+    return retval;
+ c_errno:
+    syslog(LOG_ERR, "%s", strerror(errno));
+    goto cleanup;
+}
+
+bool mpay_execute_purchase(mpay                    *_mpay,
+                           struct mpay_form        *_form,
+                           enum mpay_payment_state *_opt_state,
+                           char                   **_opt_url_m,
+                           json_t                 **_opt_result) {
+    mpay_trace_begin(&_mpay->trace, __func__, _form->payment.order);
+    return mpay_purchase(_mpay, "/v1/payments", _form, _opt_state, _opt_url_m, _opt_result);
+}
+
+bool mpay_execute_purchase_rtoken(mpay                    *_mpay,
+                                  struct mpay_form        *_form,
+                                  enum mpay_payment_state *_opt_state,
+                                  char                   **_opt_url_m,
+                                  json_t                 **_opt_result) {
+    mpay_trace_begin(&_mpay->trace, __func__, _form->payment.order);
+    return mpay_purchase(_mpay, "/v1/payments/rtoken", _form, _opt_state, _opt_url_m, _opt_result);
+}
+
+static bool mpay_payment_info_parse(json_t                  *j,
+                                    crest_result            *_rh,
+                                    enum mpay_payment_state *_opt_state,
+                                    json_t                 **_opt_info,
+                                    json_t                 **_opt_history) {
+    int          e;
+    json_t      *j_payment, *j_state, *j_history, *j_err;
+    int          n;
+
+    /* Handle normal error cases. */
+    j_err = json_object_get(j, "errorCode");
+    if (j_err &&
+        json_is_integer(j_err) &&
+        ((n=json_integer_value(j_err)) >= 300 || n==130)) {
+        if (_opt_state)   *_opt_state   = MPAY_PAYMENT_UNFINISHED;
+        if (_opt_history) *_opt_history = json_array();
+        if (_opt_info)    *_opt_info    = json_object();
+        return true;
+    }
+    j_payment = json_object_get(j, "payment");
+    e = j_payment && json_is_object(j_payment);
+    if (!e/*err*/) goto cleanup_invalid_response;
+    j_state = json_object_get(j_payment, "state");
+    e = j_state && json_is_integer(j_state);
+    if (!e/*err*/) goto cleanup_invalid_response;
+    j_history = json_object_get(j_payment, "history");
+    e = j_history && json_is_array(j_history);
+    if (!e/*err*/) goto cleanup_invalid_response;
+    if (_opt_state) {
+        long s = json_integer_value(j_state);
+        if (s != 0 && s != 1 && s != 2/*err*/) goto cleanup_invalid_response;
+        if (e == 1) {
+            json_t *e; int i;
+            json_array_foreach(j_history, i, e) {
+                long c = json_object_get_integer(e, "operationType");
+                if (c == 2) {
+                    s = MPAY_PAYMENT_REFUNDED;
+                    break;
+                }
+            }
+            
+        }
+        
+        *_opt_state = s;
+    }
+    if (_opt_history) {
+        *_opt_history = json_incref(j_history);
+    }
+    if (_opt_info) {
+        json_object_del(j_payment, "history");
+        *_opt_info = json_incref(j_payment);
+    }    
+    return true;
+ cleanup_invalid_response:
+    syslog(LOG_ERR, "Invalid response: %.*s", (int)_rh->dsz, _rh->d);
+    return false;
+}
+
+bool mpay_payment_info(mpay *_mpay,
+                       const char *_order,
+                       enum mpay_payment_state *_opt_state,
+                       json_t    **_opt_info,
+                       json_t    **_opt_history) {
+    int          e;
+    bool         ret = false;
+    char        *body = NULL;
+    json_t      *j   = NULL;
+    crest_result rh  = {0};
+
+    /* Check _mpay has the credentials. */
+    mpay_trace_begin(&_mpay->trace, __func__, _order);
+    e = mpay_chk_auth(_mpay, NULL);
+    if (!e/*err*/) goto cleanup;
+
+    /* Set the request body. */
+    e = asprintf(&body, "{\"terminal\": %li}", _mpay->auth_terminal);
+    if (e<0/*err*/) { body = NULL; goto cleanup_errno; }
+
+    /* Perform the request and get response. */
+    e = mpay_perform_shared(_mpay, &rh, body, "%s/v1/payments/%s/info", MPAY_URL, _order);
+    if (!e/*err*/) goto cleanup;
+    e = crest_get_json(&j, rh.ctype, rh.rcode, rh.d, rh.dsz);
+    if (!e/*err*/) goto cleanup;
+    ret = mpay_payment_info_parse(j, &rh, _opt_state, _opt_info, _opt_history);
+ cleanup:
+    mpay_trace_end(&_mpay->trace, j, rh.rcode, ret, _mpay->error);
+    if (j) json_decref(j);
+    free(body);
+    return ret;
+ cleanup_errno:
+    syslog(LOG_ERR, "%s", strerror(errno));
+    goto cleanup;
+}
+
+json_t *payment_info_to_refund(json_t *_i, coin_t _opt_different_amount) {
+    json_t *o = json_object();
+    json_t *i_terminal = json_incref(json_object_get(_i, "terminal"));
+    json_t *i_amount   = __extension__ ({
+            json_t *j; long_ss ls;
+            if (_opt_different_amount.cents) {
+                j = json_string(long_str(_opt_different_amount.cents, &ls));
+            } else {
+                j = json_incref(json_object_get(_i, "amount"));
+            }
+            j;
+        });
+    json_t *i_currency = __extension__ ({
+            json_t *j; char *s,*p;
+            if (_opt_different_amount.cents) {
+                s = strdupa(_opt_different_amount.currency);
+                for (p = s; *p; p++) *p = toupper(*p);
+                j = json_string(s);
+            } else {
+                j = json_incref(json_object_get(_i, "currency"));
+            }
+            j;
+        });
+    json_t *i_authCode   = json_incref(json_object_get(_i, "authCode"));
+    json_t *i_originalIp = json_incref(json_object_get(_i, "originalIp"));
+    int res = o && i_terminal && i_amount && i_currency && i_authCode && i_originalIp;
+    if (!res/*err*/) {
+        json_decref(o);
+        json_decref(i_terminal);
+        json_decref(i_amount);
+        json_decref(i_currency);
+        json_decref(i_authCode);
+        json_decref(i_originalIp);
+        return NULL;
+    }
+    json_t *p = json_object();
+    json_object_set(p, "terminal"  , i_terminal);
+    json_object_set(p, "amount"    , i_amount);
+    json_object_set(p, "currency"  , i_currency);
+    json_object_set(p, "authCode"  , i_authCode);
+    json_object_set(p, "originalIp", i_originalIp);
+    json_object_set(o, "payment", p);
+    return o;
+}
+
+bool mpay_payment_refund(mpay *_mpay,
+                         const char *_order,
+                         json_t     *_info,
+                         coin_t      _opt_different_amount,
+                         json_t    **_opt_result) {
+    int          e;
+    bool         ret = false;
+    json_t      *req = NULL;
+    char        *body = NULL;
+    crest_result hr  = {0};
+    json_t      *j   = NULL;
+    mpay_trace_begin(&_mpay->trace, __func__, _order);
+    req = payment_info_to_refund(_info, _opt_different_amount);
+    if (!req/*err*/) goto cleanup;
+    e = mpay_chk_auth(_mpay, NULL);
+    if (!e/*err*/) goto cleanup_unauthorized;
+    body = json_dumps(req, JSON_INDENT(4));
+    if (!body/*err*/) goto cleanup_errno;
+    e = mpay_perform(_mpay, &hr, body, "%s/v1/payments/%s/refund", MPAY_URL, _order);
+    if (!e/*err*/) goto cleanup;
+    e = crest_get_json(&j, hr.ctype, hr.rcode, hr.d, hr.dsz);
+    if (!e/*err*/) goto cleanup;
+    if (_opt_result) {
+        *_opt_result = json_incref(j);
+    }
+    ret = true;
+    goto cleanup;
+ cleanup_errno:
+    syslog(LOG_ERR, "%s", strerror(errno));
+    goto cleanup;
+ cleanup_unauthorized:
+    syslog(LOG_ERR, "Not configured.");
+    goto cleanup;
+ cleanup:
+    mpay_trace_end(&_mpay->trace, j, hr.rcode, ret, _mpay->error);
+    if (j) json_decref(j);
+    if (req) json_decref(req);
+    free(body);
+    return ret;
+}
+
+/* ---- Non-blocking operations. ----
+ *
+ * Operations run in a libcurl multi handle with connections of its
+ * own, sharing the DNS and TLS session caches with the blocking calls.
+ * The caller's event loop either watches the sockets reported
+ * through mpay_op_set_watch() or calls mpay_op_wait(), and then
+ * mpay_op_progress(). */
+
+enum mpay_op_type {
+    MPAY_OP_HEARTBEAT,
+    MPAY_OP_EXCHANGE,
+    MPAY_OP_FORM,
+    MPAY_OP_PURCHASE,
+    MPAY_OP_PAYMENT_INFO,
+    MPAY_OP_REFUND
+};
+
+struct mpay_op {
+    mpay                    *mpay;
+    enum mpay_op_type        type;
+    CURL                    *curl;
+    struct curl_slist       *headers;
+    char                    *url;
+    char                    *body;
+    struct mpay_buf          resp;
+    struct timespec          t1;
+    crest_result             rh;
+    bool                     done;
+    bool                     ok;
+    enum mpay_error          error;
+    void                    *data;
+    mpay_op                 *next;
+    /* Scheduling. */
+    enum mpay_priority       priority;
+    bool                     slot;
+    bool                     pending;
+    struct timespec          tq;
+    mpay_op                 *pending_next;
+    /* Timed replay, answered with `rec` at `due`. */
+    struct mpay_rec         *rec;
+    struct timespec          due;
+    mpay_op                 *replay_next;
+    struct mpay_trace        trace;
+    /* Results. */
+    json_t                  *json;
+    enum mpay_payment_state  state;
+    json_t                  *info;
+    json_t                  *history;
+    char                    *url_m;
+    coin_t                   coin;
+};
+
+static int mpay_op_socket_cb(CURL *_curl, curl_socket_t _s, int _what, void *_udata, void *_sockp) {
+    mpay *m  = _udata;
+    int   ev = 0;
+    if (_what == CURL_POLL_IN  || _what == CURL_POLL_INOUT) ev |= MPAY_OP_READ;
+    if (_what == CURL_POLL_OUT || _what == CURL_POLL_INOUT) ev |= MPAY_OP_WRITE;
+    m->op_watch(m->op_udata, _s, ev);
+    return 0;
+}
+
+static int mpay_op_timer_cb(CURLM *_multi, long _ms, void *_udata) {
+    mpay *m = _udata;
+    m->op_timer_on = (_ms >= 0);
+    if (m->op_timer_on) {
+        clock_gettime(CLOCK_MONOTONIC, &m->op_timer_at);
+        m->op_timer_at.tv_sec  += _ms/1000;
+        m->op_timer_at.tv_nsec += (_ms%1000)*1000000;
+        if (m->op_timer_at.tv_nsec >= 1000000000) {
+            m->op_timer_at.tv_sec++;
+            m->op_timer_at.tv_nsec -= 1000000000;
+        }
+    }
+    m->op_timer(m->op_udata, _ms);
+    return 0;
+}
+
+/* Operations waiting for the scheduler are retried every few
+ * milliseconds and replayed ones finish when their recorded latency
+ * elapses, the caller's timer is shortened meanwhile and given back to
+ * libcurl after. */
+#define MPAY_OP_ADMIT_MS 10
+
+static long mpay_op_replay_ms(mpay *_mpay) {
+    struct timespec now;
+    long            ms = -1, due;
+    if (!_mpay->op_replay_first) return -1;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (mpay_op *op = _mpay->op_replay_first; op; op = op->replay_next) {
+        due = (op->due.tv_sec-now.tv_sec)*1000+(op->due.tv_nsec-now.tv_nsec+999999)/1000000;
+        if (due < 0) due = 0;
+        if (ms < 0 || due < ms) ms = due;
+    }
+    return ms;
+}
+
+static void mpay_op_timer_arm(mpay *_mpay) {
+    struct timespec now;
+    long            ms = -1, replay_ms;
+    bool            ours = _mpay->op_pending_first || _mpay->op_replay_first;
+    if (!_mpay->op_timer || (!ours && !_mpay->op_timer_ours)) return;
+    if (_mpay->op_timer_on) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        ms = (_mpay->op_timer_at.tv_sec-now.tv_sec)*1000+(_mpay->op_timer_at.tv_nsec-now.tv_nsec)/1000000;
+        if (ms < 0) ms = 0;
+    }
+    _mpay->op_timer_ours = ours;
+    if (_mpay->op_pending_first && (ms < 0 || ms > MPAY_OP_ADMIT_MS)) {
+        ms = MPAY_OP_ADMIT_MS;
+    }
+    replay_ms = mpay_op_replay_ms(_mpay);
+    if (replay_ms >= 0 && (ms < 0 || ms > replay_ms)) {
+        ms = replay_ms;
+    }
+    _mpay->op_timer(_mpay->op_udata, ms);
+}
+
+void mpay_op_set_watch(mpay *_mpay, mpay_op_watch_f _watch, mpay_op_timer_f _timer, void *_udata) {
+    _mpay->op_watch = _watch;
+    _mpay->op_timer = _timer;
+    _mpay->op_udata = _udata;
+    if (_mpay->multi) {
+        curl_multi_setopt(_mpay->multi, CURLMOPT_SOCKETFUNCTION, (_watch)?mpay_op_socket_cb:NULL);
+        curl_multi_setopt(_mpay->multi, CURLMOPT_SOCKETDATA    , _mpay);
+        curl_multi_setopt(_mpay->multi, CURLMOPT_TIMERFUNCTION , (_timer)?mpay_op_timer_cb:NULL);
+        curl_multi_setopt(_mpay->multi, CURLMOPT_TIMERDATA     , _mpay);
+    }
+}
+
+static mpay_op *mpay_op_new(mpay *_mpay, enum mpay_op_type _type) {
+    mpay_op *op = calloc(1, sizeof(struct mpay_op));
+    if (!op/*err*/) {
+        syslog(LOG_ERR, "%s", strerror(errno));
+        mpay_trace_end(&_mpay->trace, NULL, 0, false, MPAY_ERROR_NONE);
+        return NULL;
+    }
+    op->mpay     = _mpay;
+    op->type     = _type;
+    op->priority = _mpay->priority;
+    op->trace    = _mpay->trace;
+    _mpay->trace.on = false;
+    _mpay->op_count++;
+    return op;
+}
+
+static void mpay_op_finish(mpay_op *_op, bool _ok) {
+    mpay *m = _op->mpay;
+    if (_ok) {
+        _ok = crest_get_json(&_op->json, _op->rh.ctype, _op->rh.rcode, _op->rh.d, _op->rh.dsz);
+    }
+    if (_ok) {
+        switch (_op->type) {
+        case MPAY_OP_HEARTBEAT:
+            _ok = mpay_heartbeat_parse(_op->json, &_op->rh, NULL);
+            break;
+        case MPAY_OP_EXCHANGE:
+            _ok = mpay_exchange_parse(_op->json, &_op->rh, &_op->coin);
+            break;
+        case MPAY_OP_FORM:
+            _ok = mpay_form_parse(_op->json, &_op->rh, &_op->url_m);
+            break;
+        case MPAY_OP_PURCHASE:
+            _ok = mpay_purchase_parse(_op->json, &_op->rh, &_op->state, &_op->url_m);
+            break;
+        case MPAY_OP_PAYMENT_INFO:
+            _ok = mpay_payment_info_parse(_op->json, &_op->rh, &_op->state, &_op->info, &_op->history);
+            break;
+        case MPAY_OP_REFUND:
+            break;
+        }
+    }
+    _op->ok   = _ok;
+    _op->done = true;
+    mpay_trace_end(&_op->trace, _op->json, _op->rh.rcode, _ok, _op->error);
+    if (m->op_done_last) {
+        m->op_done_last->next = _op;
+    } else {
+        m->op_done_first = _op;
+    }
+    m->op_done_last = _op;
+}
+
+static bool mpay_op_attach(mpay_op *_op) {
+    mpay     *m = _op->mpay;
+    CURLMcode me;
+    if (!m->multi) {
+        m->multi = curl_multi_init();
+        if (!m->multi/*err*/) goto cleanup_curl;
+        mpay_op_set_watch(m, m->op_watch, m->op_timer, m->op_udata);
+    }
+    _op->headers = mpay_headers(m->auth_api_token);
+    if (!_op->headers/*err*/) goto cleanup_curl;
+    _op->curl = curl_easy_init();
+    if (!_op->curl/*err*/) goto cleanup_curl;
+    mpay_curl_setup(m, _op->curl, _op->headers, _op->url, _op->body, &_op->resp);
+    curl_easy_setopt(_op->curl, CURLOPT_PRIVATE, _op);
+    mpay_trace_mark(&_op->trace, MPAY_PHASE_ACQUIRE);
+    clock_gettime(CLOCK_MONOTONIC, &_op->t1);
+    me = curl_multi_add_handle(m->multi, _op->curl);
+    if (me != CURLM_OK/*err*/) goto cleanup_curl;
+    return true;
+ cleanup_curl:
+    syslog(LOG_ERR, "Can't start operation.");
+    if (_op->curl) {
+        curl_easy_cleanup(_op->curl);
+        _op->curl = NULL;
+    }
+    return false;
+}
+
+static void mpay_op_unslot(mpay_op *_op, bool _sample, bool _dropped) {
+    if (_op->slot) {
+        _op->slot = false;
+        mpay_sched_release(_op->priority, (_sample)?&_op->t1:NULL, _dropped);
+    }
+}
+
+/* Start queued operations when the scheduler lets them, interactive
+ * first, and shed background ones that waited too long, or any when
+ * over the adaptive limit for too long. */
+static void mpay_op_admit(mpay *_mpay) {
+    for (int p=0; p<2; p++) {
+        mpay_op **pp   = &_mpay->op_pending_first;
+        mpay_op  *prev = NULL;
+        while (*pp) {
+            mpay_op        *op  = *pp;
+            bool            run = false;
+            enum mpay_error e   = MPAY_ERROR_NONE;
+            if (op->priority != p) {
+                prev = op;
+                pp   = &op->pending_next;
+                continue;
+            }
+            pthread_mutex_lock(&mpay_sched.lock);
+            if (mpay_sched_can(op->priority)) {
+                mpay_sched.s.prio[p].queued--;
+                mpay_sched_admitted(op->priority, &op->tq);
+                op->slot = run = true;
+            } else if (!mpay_sched_left(op->priority, &op->tq, &e)) {
+                mpay_sched.s.prio[p].queued--;
+            } else {
+                pthread_mutex_unlock(&mpay_sched.lock);
+                break;
+            }
+            pthread_mutex_unlock(&mpay_sched.lock);
+            *pp = op->pending_next;
+            if (_mpay->op_pending_last == op) _mpay->op_pending_last = prev;
+            op->pending      = false;
+            op->pending_next = NULL;
+            if (!run) {
+                syslog(LOG_ERR, "%s: %s by the scheduler.", op->url,
+                       (e == MPAY_ERROR_LIMIT)?"Rejected":"Shed");
+                op->error = e;
+                mpay_op_finish(op, false);
+            } else if (!mpay_op_attach(op)/*err*/) {
+                op->error = MPAY_ERROR_NETWORK;
+                mpay_op_unslot(op, false, false);
+                mpay_op_finish(op, false);
+            }
+        }
+    }
+}
+
+/* Finish the replayed operations whose recorded latency elapsed. */
+static void mpay_op_replay(mpay *_mpay) {
+    struct timespec now;
+    mpay_op       **pp = &_mpay->op_replay_first;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    while (*pp) {
+        mpay_op *op = *pp;
+        if (op->due.tv_sec > now.tv_sec ||
+            (op->due.tv_sec == now.tv_sec && op->due.tv_nsec > now.tv_nsec)) {
+            pp = &op->replay_next;
+            continue;
+        }
+        *pp = op->replay_next;
+        op->replay_next = NULL;
+        mpay_op_finish(op, mpay_rec_result(op->rec, &op->rh, &op->error));
+        op->rec = NULL;
+    }
+}
+
+static bool mpay_op_launch(mpay_op *_op, mpay_op **_opt_op, const char *_url_fmt, ...) {
+    mpay     *m = _op->mpay;
+    va_list   va;
+    int       e;
+    mpay_trace_mark(&_op->trace, MPAY_PHASE_BUILD);
+    if (!_op->body/*err*/) goto cleanup;
+    va_start(va, _url_fmt);
+    e = vasprintf(&_op->url, _url_fmt, va);
+    va_end(va);
+    if (e==-1/*err*/) { _op->url = NULL; goto cleanup_errno; }
+    if (m->transport == MPAY_TRANSPORT_REPLAY ||
+        m->transport == MPAY_TRANSPORT_REPLAY_TIMED) {
+        /* Replayed operations finish at once or, timed, after the
+         * recorded latency (see mpay_op_replay()). */
+        _op->rec = mpay_rec_find(m, _op->url, _op->body);
+        if (_op->rec && m->transport == MPAY_TRANSPORT_REPLAY_TIMED && _op->rec->usec > 0) {
+            clock_gettime(CLOCK_MONOTONIC, &_op->due);
+            _op->due.tv_sec  += _op->rec->usec/1000000;
+            _op->due.tv_nsec += (_op->rec->usec%1000000)*1000;
+            if (_op->due.tv_nsec >= 1000000000) {
+                _op->due.tv_sec++;
+                _op->due.tv_nsec -= 1000000000;
+            }
+            _op->replay_next   = m->op_replay_first;
+            m->op_replay_first = _op;
+            mpay_op_timer_arm(m);
+        } else {
+            mpay_op_finish(_op, mpay_rec_result(_op->rec, &_op->rh, &_op->error));
+            _op->rec = NULL;
+        }
+        if (_opt_op) *_opt_op = _op;
+        return true;
+    }
+    pthread_mutex_lock(&mpay_sched.lock);
+    if (mpay_sched_can(_op->priority)) {
+        mpay_sched_admitted(_op->priority, NULL);
+        _op->slot = true;
+    } else if (mpay_sched_limited(_op->priority) && !mpay_sched.limit_wait_ms) {
+        mpay_sched.s.prio[_op->priority].limited++;
+        _op->error = MPAY_ERROR_LIMIT;
+    } else if (mpay_sched_queue(_op->priority)) {
+        _op->pending = true;
+    } else {
+        _op->error = MPAY_ERROR_SHED;
+    }
+    pthread_mutex_unlock(&mpay_sched.lock);
+    if (_op->pending) {
+        clock_gettime(CLOCK_MONOTONIC, &_op->tq);
+        if (m->op_pending_last) {
+            m->op_pending_last->pending_next = _op;
+        } else {
+            m->op_pending_first = _op;
+        }
+        m->op_pending_last = _op;
+        mpay_op_timer_arm(m);
+    } else if (!_op->slot) {
+        syslog(LOG_ERR, "%s: %s by the scheduler.", _op->url,
+               (_op->error == MPAY_ERROR_LIMIT)?"Rejected":"Shed");
+        mpay_op_finish(_op, false);
+    } else if (!mpay_op_attach(_op)/*err*/) {
+        goto cleanup;
+    }
+    if (_opt_op) *_opt_op = _op;
+    return true;
+ cleanup_errno:
+    syslog(LOG_ERR, "%s", strerror(errno));
+    goto cleanup;
+ cleanup:
+    mpay_trace_end(&_op->trace, NULL, 0, false, _op->error);
+    mpay_op_destroy(_op);
+    return false;
+}
+
+static bool mpay_op_begin(mpay *_mpay, const char *_name, const char *_order) {
+    mpay_trace_begin(&_mpay->trace, _name, _order);
+    if (!mpay_chk_auth(_mpay, NULL)/*err*/) {
+        mpay_trace_end(&_mpay->trace, NULL, 0, false, MPAY_ERROR_NONE);
+        return false;
+    }
+    return true;
+}
+
+bool mpay_op_start_heartbeat(mpay *_mpay, mpay_op **_op) {
+    mpay_op *op;
+    if (!mpay_op_begin(_mpay, __func__, NULL)/*err*/) return false;
+    if (!(op = mpay_op_new(_mpay, MPAY_OP_HEARTBEAT))/*err*/) return false;
+    if (asprintf(&op->body, "{\"terminal\": %li}", _mpay->auth_terminal)==-1) op->body = NULL;
+    return mpay_op_launch(op, _op, "%s/v1/heartbeat", MPAY_URL);
+}
+
+bool mpay_op_start_exchange(mpay *_mpay, mpay_op **_op, coin_t _fr, const char *_currency) {
+    mpay_op *op;
+    if (!mpay_op_begin(_mpay, __func__, NULL)/*err*/) return false;
+    if (!(op = mpay_op_new(_mpay, MPAY_OP_EXCHANGE))/*err*/) return false;
+    op->body = mpay_exchange_body(_mpay, _fr, &op->coin, _currency);
+    return mpay_op_launch(op, _op, "%s/v1/exchange", MPAY_URL);
+}
+
+bool mpay_op_start_form(mpay *_mpay, mpay_op **_op, struct mpay_form *_form) {
+    mpay_op *op;
+    json_t  *req;
+    if (!mpay_op_begin(_mpay, __func__, _form->payment.order)/*err*/) return false;
+    if (!(op = mpay_op_new(_mpay, MPAY_OP_FORM))/*err*/) return false;
+    if ((req = mpay_form_to_json(_mpay, _form))) {
+        op->body = json_dumps(req, JSON_INDENT(4));
+        json_decref(req);
+    }
+    return mpay_op_launch(op, _op, "%s/v1/form", MPAY_URL);
+}
+
+bool mpay_op_start_purchase(mpay *_mpay, mpay_op **_op, struct mpay_form *_form) {
+    mpay_op *op;
+    json_t  *req;
+    if (!mpay_op_begin(_mpay, __func__, _form->payment.order)/*err*/) return false;
+    if (!(op = mpay_op_new(_mpay, MPAY_OP_PURCHASE))/*err*/) return false;
+    if ((req = mpay_form_to_purchase(_mpay, _form))) {
+        op->body = json_dumps(req, JSON_INDENT(4));
+        json_decref(req);
+    }
+    return mpay_op_launch(op, _op, "%s/v1/payments", MPAY_URL);
+}
+
+bool mpay_op_start_payment_info(mpay *_mpay, mpay_op **_op, const char *_order) {
+    mpay_op *op;
+    if (!mpay_op_begin(_mpay, __func__, _order)/*err*/) return false;
+    if (!(op = mpay_op_new(_mpay, MPAY_OP_PAYMENT_INFO))/*err*/) return false;
+    if (asprintf(&op->body, "{\"terminal\": %li}", _mpay->auth_terminal)==-1) op->body = NULL;
+    return mpay_op_launch(op, _op, "%s/v1/payments/%s/info", MPAY_URL, _order);
+}
+
+bool mpay_op_start_refund(mpay       *_mpay,
+                          mpay_op   **_op,
+                          const char *_order,
+                          json_t     *_info,
+                          coin_t      _opt_different_amount) {
+    mpay_op *op;
+    json_t  *req;
+    if (!mpay_op_begin(_mpay, __func__, _order)/*err*/) return false;
+    if (!(op = mpay_op_new(_mpay, MPAY_OP_REFUND))/*err*/) return false;
+    if ((req = payment_info_to_refund(_info, _opt_different_amount))) {
+        op->body = json_dumps(req, JSON_INDENT(4));
+        json_decref(req);
+    }
+    return mpay_op_launch(op, _op, "%s/v1/payments/%s/refund", MPAY_URL, _order);
+}
+
+bool mpay_op_progress(mpay *_mpay, int _fd, int _events, int *_opt_running) {
+    int        running = 0, replaying = 0;
+    int        left;
+    CURLMcode  me;
+    CURLMsg   *msg;
+    mpay_op_replay(_mpay);
+    mpay_op_admit(_mpay);
+    for (mpay_op *op = _mpay->op_replay_first; op; op = op->replay_next) {
+        replaying++;
+    }
+    if (!_mpay->multi) {
+        mpay_op_timer_arm(_mpay);
+        if (_opt_running) *_opt_running = replaying;
+        return true;
+    }
+    if (_mpay->op_watch) {
+        int ev = 0;
+        if (_events & MPAY_OP_READ)  ev |= CURL_CSELECT_IN;
+        if (_events & MPAY_OP_WRITE) ev |= CURL_CSELECT_OUT;
+        me = curl_multi_socket_action(_mpay->multi, (_fd<0)?CURL_SOCKET_TIMEOUT:_fd, ev, &running);
+    } else {
+        me = curl_multi_perform(_mpay->multi, &running);
+    }
+    if (me != CURLM_OK/*err*/) {
+        syslog(LOG_ERR, "%s", curl_multi_strerror(me));
+        return false;
+    }
+    while ((msg = curl_multi_info_read(_mpay->multi, &left))) {
+        mpay_op  *op = NULL;
+        CURLcode  ce;
+        if (msg->msg != CURLMSG_DONE) continue;
+        ce = msg->data.result;
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&op);
+        curl_multi_remove_handle(_mpay->multi, op->curl);
+        mpay_op_unslot(op, true, ce != CURLE_OK);
+        if (ce == CURLE_OK) {
+            mpay_perform_end(_mpay, op->curl, op->url, op->body, &op->resp, &op->t1, &op->rh, &op->trace);
+        } else {
+            mpay_trace_curl(&op->trace, op->curl, true);
+            syslog(LOG_ERR, "%s: %s", op->url, curl_easy_strerror(ce));
+            op->error = MPAY_ERROR_NETWORK;
+            mpay_rec_failure(_mpay, op->url, op->body, &op->t1);
+        }
+        mpay_op_finish(op, ce == CURLE_OK);
+        curl_easy_cleanup(op->curl);
+        op->curl = NULL;
+    }
+    if (_mpay->op_pending_first) {
+        mpay_op_admit(_mpay);
+    }
+    mpay_op_timer_arm(_mpay);
+    if (_opt_running) *_opt_running = running+replaying;
+    return true;
+}
+
+bool mpay_op_wait(mpay *_mpay, int _timeout_ms, int *_opt_running) {
+    CURLMcode me;
+    long      t;
+    if (_mpay->op_pending_first && (_timeout_ms < 0 || _timeout_ms > MPAY_OP_ADMIT_MS)) {
+        _timeout_ms = MPAY_OP_ADMIT_MS;
+    }
+    t = mpay_op_replay_ms(_mpay);
+    if (t >= 0 && (_timeout_ms < 0 || _timeout_ms > t)) {
+        _timeout_ms = t;
+    }
+    /* Without limit libcurl's own timer bounds the wait, there is none
+     * when no transfer is running. */
+    if (_timeout_ms < 0 && _mpay->multi) {
+        me = curl_multi_timeout(_mpay->multi, &t);
+        _timeout_ms = (me == CURLM_OK && t >= 0)?INT_MAX:0;
+    }
+    if (!_mpay->multi && (_mpay->op_pending_first || _mpay->op_replay_first) && !_mpay->op_done_first) {
+        usleep(_timeout_ms*1000);
+    } else if (_mpay->multi && !_mpay->op_done_first) {
+        me = curl_multi_poll(_mpay->multi, NULL, 0, _timeout_ms, NULL);
+        if (me != CURLM_OK/*err*/) {
+            syslog(LOG_ERR, "%s", curl_multi_strerror(me));
+            return false;
+        }
+    }
+    return mpay_op_progress(_mpay, -1, 0, _opt_running);
+}
+
+mpay_op *mpay_op_next(mpay *_mpay) {
+    mpay_op *op = _mpay->op_done_first;
+    if (op) {
+        _mpay->op_done_first = op->next;
+        if (!_mpay->op_done_first) _mpay->op_done_last = NULL;
+        op->next = NULL;
+    }
+    return op;
+}
+
+bool mpay_op_done(mpay_op *_op) {
+    return _op->done;
+}
+
+void mpay_op_set_data(mpay_op *_op, void *_data) {
+    _op->data = _data;
+}
+
+void *mpay_op_get_data(mpay_op *_op) {
+    return _op->data;
+}
+
+bool mpay_op_result(mpay_op *_op, json_t **_opt_r) {
+    if (!_op->done || !_op->ok) return false;
+    if (_opt_r) *_opt_r = json_incref(_op->json);
+    return true;
+}
+
+long mpay_op_rcode(mpay_op *_op) {
+    return (_op->done)?_op->rh.rcode:0;
+}
+
+enum mpay_error mpay_op_error(mpay_op *_op) {
+    return _op->error;
+}
+
+bool mpay_op_payment_info(mpay_op                 *_op,
+                          enum mpay_payment_state *_opt_state,
+                          json_t                 **_opt_info,
+                          json_t                 **_opt_history) {
+    if (!_op->done || !_op->ok || _op->type != MPAY_OP_PAYMENT_INFO) return false;
+    if (_opt_state)   *_opt_state   = _op->state;
+    if (_opt_info)    *_opt_info    = json_incref(_op->info);
+    if (_opt_history) *_opt_history = json_incref(_op->history);
+    return true;
+}
+
+bool mpay_op_url(mpay_op *_op, enum mpay_payment_state *_opt_state, char **_opt_url_m) {
+    if (!_op->done || !_op->ok) return false;
+    if (_op->type != MPAY_OP_FORM && _op->type != MPAY_OP_PURCHASE) return false;
+    if (_opt_state) {
+        *_opt_state = (_op->type == MPAY_OP_FORM)?MPAY_PAYMENT_UNFINISHED:_op->state;
+    }
+    if (_opt_url_m) {
+        *_opt_url_m = NULL;
+        if (_op->url_m && !(*_opt_url_m = strdup(_op->url_m))/*err*/) {
+            syslog(LOG_ERR, "%s", strerror(errno));
+            return false;
+        }
+    }
+    return true;
+}
+
+bool mpay_op_exchange(mpay_op *_op, coin_t *_to) {
+    if (!_op->done || !_op->ok || _op->type != MPAY_OP_EXCHANGE) return false;
+    *_to = _op->coin;
+    return true;
+}
+
+void mpay_op_destroy(mpay_op *_op) {
+    if (_op) {
+        mpay *m = _op->mpay;
+        if (_op->curl) {
+            if (m->multi) curl_multi_remove_handle(m->multi, _op->curl);
+            curl_easy_cleanup(_op->curl);
+        }
+        mpay_op_unslot(_op, false, false);
+        if (_op->pending) {
+            pthread_mutex_lock(&mpay_sched.lock);
+            mpay_sched.s.prio[_op->priority].queued--;
+            pthread_mutex_unlock(&mpay_sched.lock);
+            for (mpay_op **p = &m->op_pending_first, *prev = NULL; *p; prev = *p, p = &(*p)->pending_next) {
+                if (*p == _op) {
+                    *p = _op->pending_next;
+                    if (m->op_pending_last == _op) m->op_pending_last = prev;
+                    break;
+                }
+            }
+        }
+        if (_op->rec) {
+            for (mpay_op **p = &m->op_replay_first; *p; p = &(*p)->replay_next) {
+                if (*p == _op) {
+                    *p = _op->replay_next;
+                    break;
+                }
+            }
+        }
+        for (mpay_op **p = &m->op_done_first, *prev = NULL; *p; prev = *p, p = &(*p)->next) {
+            if (*p == _op) {
+                *p = _op->next;
+                if (m->op_done_last == _op) m->op_done_last = prev;
+                break;
+            }
+        }
+        curl_slist_free_all(_op->headers);
+        free(_op->url);
+        free(_op->body);
+        free(_op->resp.d);
+        free(_op->url_m);
+        if (_op->json)    json_decref(_op->json);
+        if (_op->info)    json_decref(_op->info);
+        if (_op->history) json_decref(_op->history);
+        m->op_count--;
+        free(_op);
+    }
+}
+/* ---- Bulk refunds. ----
+ *
+ * mpay_refund_many() runs the payment info and refund requests of many
+ * orders concurrently through operations. A journal records, synced to
+ * disk, "START ORDER" before each refund is sent and "DONE ORDER" or
+ * "FAIL ORDER" once PAYCOMET answers:
+ *
+ * - DONE: Skipped by later runs without asking PAYCOMET.
+ * - START alone: The refund may have been done, it is done again only
+ *   if the payment info shows no refund.
+ * - FAIL or absent: Refunded when the payment info shows no refund. */
+
+enum mpay_journal_state {
+    MPAY_JOURNAL_NONE  = 0,
+    MPAY_JOURNAL_START = 1,
+    MPAY_JOURNAL_DONE  = 2,
+    MPAY_JOURNAL_FAIL  = 3
+};
+
+struct mpay_journal_entry {
+    char                    *order;
+    size_t                   line;
+    enum mpay_journal_state  state;
+};
+
+struct mpay_refund_job {
+    struct mpay_refund      *r;
+    enum mpay_journal_state  journaled;
+    mpay_op                 *op;
+    bool                     refunding;
+};
+
+static int mpay_journal_cmp(const void *_a, const void *_b) {
+    const struct mpay_journal_entry *a = _a, *b = _b;
+    int c = strcmp(a->order, b->order);
+    if (c) return c;
+    return (a->line < b->line)?-1:(a->line > b->line);
+}
+
+static int mpay_journal_cmp_order(const void *_a, const void *_b) {
+    const struct mpay_journal_entry *a = _a, *b = _b;
+    return strcmp(a->order, b->order);
+}
+
+static bool mpay_journal_load(int _fd, char **_d, struct mpay_journal_entry **_v, size_t *_vsz) {
+    FILE                      *fp  = NULL;
+    char                      *d   = NULL;
+    size_t                     dsz = 0;
+    struct mpay_journal_entry *v   = NULL;
+    size_t                     vsz = 0, i, j;
+    char                      *l, *save = NULL, *save2;
+    size_t                     dlen;
+    fp = open_memstream(&d, &dsz);
+    if (!fp/*err*/) goto cleanup_errno;
+    for (;;) {
+        char    buf[4096];
+        ssize_t n = read(_fd, buf, sizeof(buf));
+        if (n < 0/*err*/) goto cleanup_errno;
+        if (n == 0) break;
+        fwrite(buf, 1, n, fp);
+    }
+    if (fclose(fp)/*err*/) { fp = NULL; goto cleanup_errno; }
+    fp = NULL;
+    /* A line without '\n' was torn by a crash, drop it from the file
+     * so the next line is appended after a complete one. */
+    for (dlen=dsz; dlen && d[dlen-1] != '\n'; dlen--);
+    if (dlen < dsz) {
+        syslog(LOG_WARNING, "Dropping torn journal line: %.*s", (int)(dsz-dlen), d+dlen);
+        if (ftruncate(_fd, dlen) == -1/*err*/) goto cleanup_errno;
+        d[dlen] = '\0';
+    }
+    for (i=0; i<dlen; i++) vsz += (d[i] == '\n');
+    v = calloc(vsz+1, sizeof(struct mpay_journal_entry));
+    if (!v/*err*/) goto cleanup_errno;
+    vsz = 0;
+    for (l = strtok_r(d, "\n", &save); l; l = strtok_r(NULL, "\n", &save)) {
+        char *cmd   = strtok_r(l, " ", &save2);
+        char *order = strtok_r(NULL, " ", &save2);
+        enum mpay_journal_state st;
+        if (!cmd || !order) continue;
+        if      (!strcmp(cmd, "START")) st = MPAY_JOURNAL_START;
+        else if (!strcmp(cmd, "DONE"))  st = MPAY_JOURNAL_DONE;
+        else if (!strcmp(cmd, "FAIL"))  st = MPAY_JOURNAL_FAIL;
+        else continue;
+        v[vsz].order = order;
+        v[vsz].line  = vsz;
+        v[vsz].state = st;
+        vsz++;
+    }
+    /* Keep the last line of each order, DONE is final. */
+    qsort(v, vsz, sizeof(struct mpay_journal_entry), mpay_journal_cmp);
+    for (i=0, j=0; i<vsz; i++) {
+        if (j && !strcmp(v[j-1].order, v[i].order)) {
+            if (v[j-1].state != MPAY_JOURNAL_DONE) v[j-1].state = v[i].state;
+        } else {
+            v[j++] = v[i];
+        }
+    }
+    *_d   = d;
+    *_v   = v;
+    *_vsz = j;
+    return true;
+ cleanup_errno:
+    syslog(LOG_ERR, "Can't read journal: %s", strerror(errno));
+    if (fp) fclose(fp);
+    free(d);
+    free(v);
+    return false;
+}
+
+static int mpay_refund_cmp_order(const void *_a, const void *_b) {
+    return strcmp(*(const char **)_a, *(const char **)_b);
+}
+
+static bool mpay_journal_write(int _fd, const char *_cmd, struct mpay_refund *_r) {
+    char   line[512];
+    int    l;
+    if (_r->amount.cents) {
+        l = snprintf(line, sizeof(line), "%s %s %li %s\n", _cmd, _r->order,
+                     _r->amount.cents, _r->amount.currency);
+    } else {
+        l = snprintf(line, sizeof(line), "%s %s\n", _cmd, _r->order);
+    }
+    if (l < 0 || l >= sizeof(line) ||
+        write(_fd, line, l) != l ||
+        fsync(_fd) == -1/*err*/) {
+        syslog(LOG_ERR, "Can't write journal: %s", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+static bool mpay_refund_next(mpay *_mpay, struct mpay_refund_job *_job) {
+    if (!mpay_op_start_payment_info(_mpay, &_job->op, _job->r->order)/*err*/) return false;
+    mpay_op_set_data(_job->op, _job);
+    return true;
+}
+
+static bool mpay_refund_info(mpay *_mpay, int _fd, struct mpay_refund_job *_job, mpay_op *_info) {
+    struct mpay_refund      *r    = _job->r;
+    enum mpay_payment_state  st;
+    json_t                  *info = NULL;
+    bool                     e;
+    if (!mpay_op_payment_info(_info, &st, &info, NULL)) {
+        r->status = (_job->journaled == MPAY_JOURNAL_START)?MPAY_REFUND_UNKNOWN:MPAY_REFUND_FAILED;
+        return false;
+    }
+    if (st == MPAY_PAYMENT_REFUNDED) {
+        /* Refunded by a previous run that died or by someone else. */
+        r->status = (_job->journaled == MPAY_JOURNAL_START)?MPAY_REFUND_DONE:MPAY_REFUND_SKIPPED;
+        mpay_journal_write(_fd, "DONE", r);
+        json_decref(info);
+        return false;
+    }
+    if (st != MPAY_PAYMENT_CORRECT) {
+        syslog(LOG_ERR, "%s: Not a completed payment.", r->order);
+        r->status = MPAY_REFUND_FAILED;
+        mpay_journal_write(_fd, "FAIL", r);
+        json_decref(info);
+        return false;
+    }
+    if (!mpay_journal_write(_fd, "START", r)/*err*/) {
+        r->status = MPAY_REFUND_FAILED;
+        json_decref(info);
+        return false;
+    }
+    _job->journaled = MPAY_JOURNAL_START;
+    _job->refunding = true;
+    e = mpay_op_start_refund(_mpay, &_job->op, r->order, info, r->amount);
+    json_decref(info);
+    if (!e/*err*/) {
+        r->status = MPAY_REFUND_UNKNOWN;
+        return false;
+    }
+    mpay_op_set_data(_job->op, _job);
+    return true;
+}
+
+static void mpay_refund_result(int _fd, struct mpay_refund_job *_job, mpay_op *_refund) {
+    struct mpay_refund *r = _job->r;
+    json_t             *j = NULL;
+    long                code;
+    if (mpay_op_result(_refund, &j)) {
+        code = json_object_get_integer(j, "errorCode");
+        if (code) {
+            syslog(LOG_ERR, "%s: Refund refused, error %li.", r->order, code);
+            r->status = MPAY_REFUND_FAILED;
+            mpay_journal_write(_fd, "FAIL", r);
+        } else if (mpay_journal_write(_fd, "DONE", r)) {
+            r->status = MPAY_REFUND_DONE;
+        } else {
+            r->status = MPAY_REFUND_UNKNOWN;
+        }
+    } else if (mpay_op_rcode(_refund) >= 400 &&
+               (j = json_loadb(_refund->rh.d, _refund->rh.dsz, 0, NULL)) &&
+               (code = json_object_get_integer(j, "errorCode"))) {
+        syslog(LOG_ERR, "%s: Refund refused, error %li.", r->order, code);
+        r->status = MPAY_REFUND_FAILED;
+        mpay_journal_write(_fd, "FAIL", r);
+    } else {
+        /* No answer, or one PAYCOMET did not explain (5xx, 429...),
+         * it stays START and the next run checks the payment info. */
+        r->status = MPAY_REFUND_UNKNOWN;
+    }
+    json_decref(j);
+}
+
+bool mpay_refund_many(mpay               *_mpay,
+                      struct mpay_refund *_v,
+                      size_t              _vsz,
+                      int                 _concurrency,
+                      const char         *_journal) {
+    bool                       retval  = false;
+    int                        fd      = -1;
+    char                      *jd      = NULL;
+    struct mpay_journal_entry *jv      = NULL;
+    size_t                     jvsz    = 0;
+    struct mpay_refund_job    *jobs    = NULL;
+    const char               **orders  = NULL;
+    const char                *order   = NULL;
+    size_t                     next    = 0;
+    int                        active  = 0;
+    mpay_op_watch_f            o_watch = _mpay->op_watch;
+    mpay_op_timer_f            o_timer = _mpay->op_timer;
+    void                      *o_udata = _mpay->op_udata;
+    mpay_op                   *op;
+    int                        e;
+
+    if (!mpay_chk_auth(_mpay, NULL)/*err*/) return false;
+    if (_mpay->op_count/*err*/) goto cleanup_busy;
+    for (size_t i=0; i<_vsz; i++) {
+        _v[i].status = MPAY_REFUND_PENDING;
+        if (!_v[i].order || !_v[i].order[0] || strpbrk(_v[i].order, " \t\r\n")/*err*/) goto cleanup_invalid_order;
+    }
+    if (_concurrency < 1) _concurrency = 1;
+
+    /* An order twice would be refunded twice. */
+    orders = calloc(_vsz+1, sizeof(char *));
+    if (!orders/*err*/) goto cleanup_errno;
+    for (size_t i=0; i<_vsz; i++) orders[i] = _v[i].order;
+    qsort(orders, _vsz, sizeof(char *), mpay_refund_cmp_order);
+    for (size_t i=1; i<_vsz; i++) {
+        if (!strcmp(orders[i-1], orders[i])/*err*/) { order = orders[i]; goto cleanup_duplicated; }
+    }
+
+    /* Open and read the journal, one process at a time. */
+    fd = open(_journal, O_RDWR|O_APPEND|O_CREAT, 0600);
+    if (fd == -1/*err*/) goto cleanup_errno;
+    if (flock(fd, LOCK_EX|LOCK_NB) == -1/*err*/) goto cleanup_errno;
+    e = mpay_journal_load(fd, &jd, &jv, &jvsz);
+    if (!e/*err*/) goto cleanup;
+    jobs = calloc(_vsz+1, sizeof(struct mpay_refund_job));
+    if (!jobs/*err*/) goto cleanup_errno;
+    for (size_t i=0; i<_vsz; i++) {
+        struct mpay_journal_entry  key = {(char *)_v[i].order, 0, 0}, *f;
+        f = bsearch(&key, jv, jvsz, sizeof(struct mpay_journal_entry), mpay_journal_cmp_order);
+        jobs[i].r         = &_v[i];
+        jobs[i].journaled = (f)?f->state:MPAY_JOURNAL_NONE;
+    }
+
+    /* Pipeline, keep `_concurrency` orders in progress. */
+    mpay_op_set_watch(_mpay, NULL, NULL, NULL);
+    while (next < _vsz || active) {
+        while (active < _concurrency && next < _vsz) {
+            struct mpay_refund_job *job = &jobs[next++];
+            if (job->journaled == MPAY_JOURNAL_DONE) {
+                job->r->status = MPAY_REFUND_SKIPPED;
+            } else if (mpay_refund_next(_mpay, job)) {
+                active++;
+            } else if (job->journaled == MPAY_JOURNAL_START) {
+                /* May have been refunded, the next run checks. */
+                job->r->status = MPAY_REFUND_UNKNOWN;
+            } else {
+                job->r->status = MPAY_REFUND_FAILED;
+            }
+        }
+        e = mpay_op_wait(_mpay, 1000, NULL);
+        if (!e/*err*/) goto cleanup_abort;
+        while ((op = mpay_op_next(_mpay))) {
+            struct mpay_refund_job *job = mpay_op_get_data(op);
+            bool                    more = false;
+            job->op = NULL;
+            if (!job->refunding) {
+                more = mpay_refund_info(_mpay, fd, job, op);
+            } else {
+                mpay_refund_result(fd, job, op);
+            }
+            mpay_op_destroy(op);
+            if (!more) active--;
+        }
+    }
+    retval = true;
+    for (size_t i=0; i<_vsz; i++) {
+        if (_v[i].status != MPAY_REFUND_DONE && _v[i].status != MPAY_REFUND_SKIPPED) retval = false;
+    }
+    goto cleanup;
+ cleanup_busy:
+    syslog(LOG_ERR, "Finish the operations of the handle first.");
+    goto cleanup;
+ cleanup_invalid_order:
+    syslog(LOG_ERR, "Invalid order identifier.");
+    goto cleanup;
+ cleanup_duplicated:
+    syslog(LOG_ERR, "%s: Order repeated.", order);
+    goto cleanup;
+ cleanup_errno:
+    syslog(LOG_ERR, "%s: %s", _journal, strerror(errno));
+    goto cleanup;
+ cleanup_abort:
+    for (size_t i=0; i<_vsz; i++) {
+        if (jobs[i].op) {
+            /* A refund without answer is checked by the next run. */
+            jobs[i].r->status = (jobs[i].refunding || jobs[i].journaled == MPAY_JOURNAL_START)?
+                MPAY_REFUND_UNKNOWN:MPAY_REFUND_FAILED;
+            mpay_op_destroy(jobs[i].op);
+        }
+    }
+    goto cleanup;
+ cleanup:
+    mpay_op_set_watch(_mpay, o_watch, o_timer, o_udata);
+    if (fd != -1) close(fd);
+    free(orders);
+    free(jobs);
+    free(jv);
+    free(jd);
+    return retval;
+}
+/* ---- Subscriptions. ----
+ *
+ * PAYCOMET's own subscriptions are fixed at form time and its REST API
+ * to manage them is unreliable, so recurring charges of stored cards
+ * can be scheduled here instead. The index is a file of fixed size
+ * records, one per subscription, updated in place. mpay_subs_run()
+ * sorts the due ones in day buckets, oldest first, and charges them
+ * through operations, `_concurrency` at a time and at most `_rate`
+ * per second.
+ *
+ * Before a charge is sent its record is marked CHARGING, synced to disk
+ * in chunks. A record found CHARGING by the next run (the answer was
+ * lost or the run died) is looked up in PAYCOMET by its order, which
+ * is unique per attempt (ID-YYYYMMDD-ATTEMPT), and charged again only
+ * when PAYCOMET does not have it. Refused charges are retried after
+ * 1, 3 and 7 days (dunning) and then the subscription is canceled. */
+
+#define MPAY_SUBS_MAGIC  "MPAYSUB1"
+#define MPAY_SUBS_WHEEL  64
+#define MPAY_SUBS_CHUNK  256
+
+static const int mpay_subs_retry[] = {1, 3, 7};
+
+struct mpay_subs_rec {
+    char     id[24];
+    char     tokenUser[64];
+    int64_t  cents;
+    char     currency[4];
+    int32_t  idUser;
+    int32_t  periodicity;
+    int32_t  due;         /* Day of the charge being collected. */
+    int32_t  retry;       /* Day of its next attempt. */
+    int32_t  end;         /* Last day, 0: Never. */
+    int32_t  charges;     /* Charged periods. */
+    uint8_t  state;
+    uint8_t  attempts;    /* Refused attempts of `due`. */
+    uint8_t  reserved[2];
+};
+
+struct mpay_subs_hdr {
+    char     magic[8];
+    uint32_t recsz;
+    uint32_t reserved;
+};
+
+struct mpay_subs_job {
+    size_t    i;
+    uint8_t   prev;       /* State before charging. */
+    bool      marked;     /* Marked CHARGING by this run. */
+    bool      checking;   /* Looking up a charge without answer. */
+    mpay_op  *op;
+};
+
+/* Days are numbered by the local calendar date, the one date_start and
+ * date_end are parsed in, counted as if it was a date in UTC. */
+static int32_t mpay_subs_day(time_t _t) {
+    struct tm tm;
+    struct tm d = {0};
+    localtime_r(&_t, &tm);
+    d.tm_year = tm.tm_year;
+    d.tm_mon  = tm.tm_mon;
+    d.tm_mday = tm.tm_mday;
+    return timegm(&d)/86400;
+}
+
+static const char *mpay_subs_day_str(int32_t _day, char _b[16]) {
+    time_t    t = (time_t)_day*86400;
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    strftime(_b, 16, "%Y/%m/%d", &tm);
+    return _b;
+}
+
+static void mpay_subs_order(struct mpay_subs_rec *_r, char _b[64]) {
+    char d[16];
+    mpay_subs_day_str(_r->due, d);
+    snprintf(_b, 64, "%s-%.4s%.2s%.2s-%u", _r->id, d, d+5, d+8, _r->attempts);
+}
+
+static bool mpay_subs_open(const char *_index, int _flags, int _lock, int *_fd, struct mpay_subs_rec **_v, size_t *_vsz) {
+    int                   fd  = -1;
+    struct mpay_subs_hdr  h   = {0};
+    struct mpay_subs_rec *v   = NULL;
+    struct stat           st;
+    size_t                sz, done;
+    ssize_t               n;
+    fd = open(_index, _flags, 0600);
+    if (fd == -1/*err*/) goto cleanup_errno;
+    if (flock(fd, _lock) == -1/*err*/) goto cleanup_errno;
+    if (fstat(fd, &st) == -1/*err*/) goto cleanup_errno;
+    if (st.st_size == 0 && (_flags & O_CREAT)) {
+        memcpy(h.magic, MPAY_SUBS_MAGIC, 8);
+        h.recsz = sizeof(struct mpay_subs_rec);
+        if (pwrite(fd, &h, sizeof(h), 0) != sizeof(h)/*err*/) goto cleanup_errno;
+        st.st_size = sizeof(h);
+    }
+    if (pread(fd, &h, sizeof(h), 0) != sizeof(h) ||
+        memcmp(h.magic, MPAY_SUBS_MAGIC, 8) ||
+        h.recsz != sizeof(struct mpay_subs_rec)/*err*/) goto cleanup_invalid;
+    sz = (st.st_size-sizeof(h))/sizeof(struct mpay_subs_rec);
+    v  = malloc((sz+1)*sizeof(struct mpay_subs_rec));
+    if (!v/*err*/) goto cleanup_errno;
+    for (done = 0; done < sz*sizeof(struct mpay_subs_rec); done += n) {
+        n = pread(fd, (char *)v+done, sz*sizeof(struct mpay_subs_rec)-done, sizeof(h)+done);
+        if (n == -1/*err*/) goto cleanup_errno;
+        if (n == 0/*err*/) goto cleanup_invalid;
+    }
+    *_fd  = fd;
+    *_v   = v;
+    *_vsz = sz;
+    return true;
+ cleanup_invalid:
+    syslog(LOG_ERR, "%s: Not a subscription index.", _index);
+    goto cleanup;
+ cleanup_errno:
+    syslog(LOG_ERR, "%s: %s", _index, strerror(errno));
+    goto cleanup;
+ cleanup:
+    if (fd != -1) close(fd);
+    free(v);
+    return false;
+}
+
+static bool mpay_subs_write(int _fd, size_t _i, struct mpay_subs_rec *_r) {
+    off_t off = sizeof(struct mpay_subs_hdr)+_i*sizeof(struct mpay_subs_rec);
+    if (pwrite(_fd, _r, sizeof(struct mpay_subs_rec), off) != sizeof(struct mpay_subs_rec)/*err*/) {
+        syslog(LOG_ERR, "Can't write subscription index: %s", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+static bool mpay_subs_sync(int _fd) {
+    if (fdatasync(_fd) == -1/*err*/) {
+        syslog(LOG_ERR, "Can't write subscription index: %s", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+static int mpay_subs_cmp_id(const void *_a, const void *_b) {
+    return strcmp(*(const char **)_a, *(const char **)_b);
+}
+
+bool mpay_subs_add(const char *_index, struct mpay_subs *_v, size_t _vsz) {
+    bool                  retval = false;
+    int                   fd     = -1;
+    struct mpay_subs_rec *v      = NULL, r;
+    size_t                vsz    = 0;
+    const char          **ids    = NULL;
+    const char           *id     = NULL;
+    int32_t               today  = mpay_subs_day(time(NULL));
+    int                   e;
+
+    /* Check the subscriptions. */
+    for (size_t i=0; i<_vsz; i++) {
+        struct mpay_subs *s = &_v[i];
+        id = s->id;
+        if (!s->id || !s->id[0] || strlen(s->id) >= sizeof(r.id) || strpbrk(s->id, " \t\r\n")/*err*/) goto cleanup_invalid_id;
+        if (s->idUser <= 0 || !s->tokenUser || strlen(s->tokenUser) >= sizeof(r.tokenUser)/*err*/) goto cleanup_invalid_token;
+        if (s->amount.cents <= 0 || strlen(s->amount.currency) != 3/*err*/) goto cleanup_invalid_amount;
+        if (s->periodicity <= 0/*err*/) goto cleanup_invalid_periodicity;
+    }
+
+    /* Read the index, check the identifiers are new. */
+    e = mpay_subs_open(_index, O_RDWR|O_CREAT, LOCK_EX, &fd, &v, &vsz);
+    if (!e/*err*/) return false;
+    ids = calloc(vsz+_vsz+1, sizeof(char *));
+    if (!ids/*err*/) goto cleanup_errno;
+    for (size_t i=0; i<vsz; i++) ids[i] = v[i].id;
+    for (size_t i=0; i<_vsz; i++) ids[vsz+i] = _v[i].id;
+    qsort(ids, vsz+_vsz, sizeof(char *), mpay_subs_cmp_id);
+    for (size_t i=1; i<vsz+_vsz; i++) {
+        if (!strcmp(ids[i-1], ids[i])/*err*/) { id = ids[i]; goto cleanup_duplicated; }
+    }
+
+    /* Append them. */
+    for (size_t i=0; i<_vsz; i++) {
+        struct mpay_subs *s = &_v[i];
+        memset(&r, 0, sizeof(r));
+        strcpy(r.id, s->id);
+        strcpy(r.tokenUser, s->tokenUser);
+        for (int c=0; c<3; c++) r.currency[c] = toupper(s->amount.currency[c]);
+        r.cents       = s->amount.cents;
+        r.idUser      = s->idUser;
+        r.periodicity = s->periodicity;
+        r.due         = (s->start_date)?mpay_subs_day(s->start_date):today;
+        r.retry       = r.due;
+        r.end         = (s->end_date)?mpay_subs_day(s->end_date):0;
+        r.state       = MPAY_SUBS_ACTIVE;
+        e = mpay_subs_write(fd, vsz+i, &r);
+        if (!e/*err*/) goto cleanup;
+    }
+    retval = mpay_subs_sync(fd);
+    goto cleanup;
+ cleanup_invalid_id:
+    syslog(LOG_ERR, "Invalid subscription identifier.");
+    return false;
+ cleanup_invalid_token:
+    syslog(LOG_ERR, "%s: Missing or invalid `idUser=ID tokenUser=TOKEN`.", id);
+    return false;
+ cleanup_invalid_amount:
+    syslog(LOG_ERR, "%s: Missing or invalid `amount=MONETARY`.", id);
+    return false;
+ cleanup_invalid_periodicity:
+    syslog(LOG_ERR, "%s: Invalid periodicity.", id);
+    return false;
+ cleanup_duplicated:
+    syslog(LOG_ERR, "%s: Subscription exists.", id);
+    goto cleanup;
+ cleanup_errno:
+    syslog(LOG_ERR, "%s", strerror(errno));
+    goto cleanup;
+ cleanup:
+    close(fd);
+    free(ids);
+    free(v);
+    return retval;
+}
+
+bool mpay_subs_cancel(const char *_index, const char *_id) {
+    bool                  retval = false;
+    int                   fd     = -1;
+    struct mpay_subs_rec *v      = NULL;
+    size_t                vsz    = 0, i;
+    int                   e;
+    e = mpay_subs_open(_index, O_RDWR, LOCK_EX, &fd, &v, &vsz);
+    if (!e/*err*/) return false;
+    for (i=0; i<vsz && strcmp(v[i].id, _id); i++) {}
+    if (i == vsz/*err*/) goto cleanup_not_found;
+    if (v[i].state == MPAY_SUBS_CHARGING) {
+        /* The charge in flight is looked up by the next run. */
+        syslog(LOG_ERR, "%s: Charge without answer, cancel after the next run.", _id);
+        goto cleanup;
+    }
+    v[i].state = MPAY_SUBS_CANCELED;
+    retval = mpay_subs_write(fd, i, &v[i]) && mpay_subs_sync(fd);
+    goto cleanup;
+ cleanup_not_found:
+    syslog(LOG_ERR, "%s: Subscription not found.", _id);
+    goto cleanup;
+ cleanup:
+    close(fd);
+    free(v);
+    return retval;
+}
+
+bool mpay_subs_list(const char *_index, FILE *_fp) {
+    static const char    *names[] = {"active", "past-due", "charging", "canceled", "ended"};
+    int                   fd      = -1;
+    struct mpay_subs_rec *v       = NULL;
+    size_t                vsz     = 0;
+    char                  d[16];
+    coin_ss               c;
+    int                   e;
+    e = mpay_subs_open(_index, O_RDONLY, LOCK_SH, &fd, &v, &vsz);
+    if (!e/*err*/) return false;
+    for (size_t i=0; i<vsz; i++) {
+        struct mpay_subs_rec *r = &v[i];
+        fprintf(_fp, "%s %s %s %s %i %i %i\n", r->id,
+                (r->state < 5)?names[r->state]:"invalid",
+                mpay_subs_day_str(r->retry, d),
+                coin_str(coin(r->cents, r->currency), c),
+                r->periodicity, r->charges, r->attempts);
+    }
+    close(fd);
+    free(v);
+    return true;
+}
+
+static void mpay_subs_charged(struct mpay_subs_rec *_r, struct mpay_subs_stats *_s) {
+    _r->charges++;
+    _r->due     += _r->periodicity;
+    _r->retry    = _r->due;
+    _r->attempts = 0;
+    _r->state    = (_r->end && _r->due > _r->end)?MPAY_SUBS_ENDED:MPAY_SUBS_ACTIVE;
+    _s->charged++;
+}
+
+static void mpay_subs_refused(struct mpay_subs_rec *_r, struct mpay_subs_stats *_s, int32_t _today) {
+    size_t n = sizeof(mpay_subs_retry)/sizeof(mpay_subs_retry[0]);
+    if (_r->attempts < n) {
+        _r->retry = _today+mpay_subs_retry[_r->attempts];
+        _r->state = MPAY_SUBS_PAST_DUE;
+        _s->refused++;
+    } else {
+        syslog(LOG_ERR, "%s: Out of retries, canceled.", _r->id);
+        _r->state = MPAY_SUBS_CANCELED;
+        _s->canceled++;
+    }
+    _r->attempts++;
+}
+
+static bool mpay_subs_start(mpay *_mpay, struct mpay_subs_rec *_r, struct mpay_subs_job *_job, const char *_ip) {
+    struct mpay_form form = {0};
+    char             order[64];
+    mpay_subs_order(_r, order);
+    if (_job->checking) {
+        if (!mpay_op_start_payment_info(_mpay, &_job->op, order)/*err*/) return false;
+    } else {
+        form.operationType          = MPAY_FORM_AUTHORIZATION;
+        form.payment.methods[0]     = MPAY_METHOD_CARD;
+        form.payment.order          = order;
+        form.payment.amount         = coin(_r->cents, _r->currency);
+        form.payment.idUser         = _r->idUser;
+        form.payment.tokenUser      = _r->tokenUser;
+        form.payment.originalIp     = _ip;
+        form.productDescription     = _r->id;
+        if (!mpay_op_start_purchase(_mpay, &_job->op, &form)/*err*/) return false;
+    }
+    mpay_op_set_data(_job->op, _job);
+    return true;
+}
+
+/* Account the answer of a charge or a look up, true when the record
+ * has to be charged (it was never seen by PAYCOMET). */
+static bool mpay_subs_result(struct mpay_subs_rec   *_r,
+                             struct mpay_subs_job   *_job,
+                             mpay_op                *_op,
+                             struct mpay_subs_stats *_s,
+                             int32_t                 _today) {
+    enum mpay_payment_state st;
+    bool                    ok;
+    ok = (_job->checking)?mpay_op_payment_info(_op, &st, NULL, NULL):mpay_op_url(_op, &st, NULL);
+    if (!ok && mpay_op_error(_op) != MPAY_ERROR_NONE && mpay_op_error(_op) != MPAY_ERROR_NETWORK) {
+        /* Not sent. */
+        _r->state = _job->prev;
+        _s->unknown++;
+    } else if (!ok) {
+        /* No answer PAYCOMET could parse (network error, 5xx, 429...),
+         * the charge may have gone through, the next run looks it up. */
+        _s->unknown++;
+    } else if (st == MPAY_PAYMENT_FAILED) {
+        mpay_subs_refused(_r, _s, _today);
+    } else if (st == MPAY_PAYMENT_CORRECT || st == MPAY_PAYMENT_REFUNDED) {
+        mpay_subs_charged(_r, _s);
+    } else if (_job->checking) {
+        /* PAYCOMET does not have it. */
+        _r->state      = (_r->attempts)?MPAY_SUBS_PAST_DUE:MPAY_SUBS_ACTIVE;
+        _job->prev     = _r->state;
+        _job->checking = false;
+        return _r->retry <= _today;
+    } else {
+        /* Asks for the customer (SCA), a recurring charge can't. */
+        syslog(LOG_ERR, "%s: The bank asks for customer authentication.", _r->id);
+        mpay_subs_refused(_r, _s, _today);
+    }
+    return false;
+}
+
+bool mpay_subs_run(mpay                   *_mpay,
+                   const char             *_index,
+                   time_t                  _now,
+                   const char             *_ip,
+                   int                     _concurrency,
+                   double                  _rate,
+                   struct mpay_subs_stats *_opt_stats) {
+    bool                    retval  = false;
+    int                     fd      = -1;
+    struct mpay_subs_rec   *v       = NULL;
+    size_t                  vsz     = 0;
+    struct mpay_subs_job   *jobs    = NULL;
+    size_t                  jobs_sz = 0;
+    int32_t                *link    = NULL;
+    int32_t                 wheel[MPAY_SUBS_WHEEL];
+    int32_t                 today   = mpay_subs_day(_now);
+    size_t                  next    = 0, marked = 0;
+    size_t                  chunk   = MPAY_SUBS_CHUNK+_concurrency;
+    int                     active  = 0;
+    struct mpay_subs_stats  s       = {0};
+    struct timespec         t, tnext;
+    mpay_op_watch_f         o_watch = _mpay->op_watch;
+    mpay_op_timer_f         o_timer = _mpay->op_timer;
+    void                   *o_udata = _mpay->op_udata;
+    mpay_op                *op;
+    int                     e;
+
+    if (!mpay_chk_auth(_mpay, NULL)/*err*/) return false;
+    if (_mpay->op_count/*err*/) goto cleanup_busy;
+    if (!_ip || !_ip[0]/*err*/) goto cleanup_invalid_ip;
+    if (_concurrency < 1/*err*/) goto cleanup_invalid_concurrency;
+
+    /* Read the index, one run at a time. */
+    e = mpay_subs_open(_index, O_RDWR, LOCK_EX|LOCK_NB, &fd, &v, &vsz);
+    if (!e/*err*/) return false;
+
+    /* Day buckets of the due subscriptions, the oldest bucket also
+     * takes those overdue for longer, charges without answer first. */
+    link = malloc((vsz+1)*sizeof(int32_t));
+    jobs = calloc(vsz+1, sizeof(struct mpay_subs_job));
+    if (!link || !jobs/*err*/) goto cleanup_errno;
+    for (int d=0; d<MPAY_SUBS_WHEEL; d++) wheel[d] = -1;
+    for (size_t i=vsz; i-- > 0;) {
+        struct mpay_subs_rec *r = &v[i];
+        int32_t               day;
+        if (r->state == MPAY_SUBS_CHARGING) {
+            jobs[jobs_sz].i        = i;
+            jobs[jobs_sz].prev     = MPAY_SUBS_CHARGING;
+            jobs[jobs_sz].checking = true;
+            jobs_sz++;
+            continue;
+        } else if ((r->state != MPAY_SUBS_ACTIVE && r->state != MPAY_SUBS_PAST_DUE) || r->retry > today) {
+            continue;
+        }
+        day = (r->retry > today-MPAY_SUBS_WHEEL+1)?r->retry:today-MPAY_SUBS_WHEEL+1;
+        link[i] = wheel[day%MPAY_SUBS_WHEEL];
+        wheel[day%MPAY_SUBS_WHEEL] = i;
+    }
+    for (int32_t day=today-MPAY_SUBS_WHEEL+1; day<=today; day++) {
+        for (int32_t i = wheel[day%MPAY_SUBS_WHEEL]; i != -1; i = link[i]) {
+            jobs[jobs_sz].i    = i;
+            jobs[jobs_sz].prev = v[i].state;
+            jobs_sz++;
+        }
+    }
+    s.due = jobs_sz;
+
+    /* Pipeline, keep `_concurrency` charges in flight. */
+    mpay_op_set_watch(_mpay, NULL, NULL, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &tnext);
+    while (next < jobs_sz || active) {
+        long wait_ms = 1000;
+        bool paced   = false;
+        /* Mark the next chunk as charging with a single sync. */
+        if (marked < jobs_sz && marked-next < (size_t)_concurrency) {
+            for (; marked < jobs_sz && marked-next < chunk; marked++) {
+                struct mpay_subs_job *job = &jobs[marked];
+                if (job->checking) continue;
+                v[job->i].state = MPAY_SUBS_CHARGING;
+                job->marked     = true;
+                e = mpay_subs_write(fd, job->i, &v[job->i]);
+                if (!e/*err*/) goto cleanup_abort;
+            }
+            e = mpay_subs_sync(fd);
+            if (!e/*err*/) goto cleanup_abort;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        while (active < _concurrency && next < marked) {
+            struct mpay_subs_job *job = &jobs[next];
+            if (_rate > 0) {
+                long ms = (tnext.tv_sec-t.tv_sec)*1000+(tnext.tv_nsec-t.tv_nsec)/1000000;
+                if (ms > 0) {
+                    wait_ms = ms;
+                    paced   = true;
+                    break;
+                }
+                tnext.tv_nsec += 1e9/_rate;
+                tnext.tv_sec  += tnext.tv_nsec/1000000000;
+                tnext.tv_nsec %= 1000000000;
+            }
+            next++;
+            if (mpay_subs_start(_mpay, &v[job->i], job, _ip)) {
+                active++;
+            } else {
+                v[job->i].state = job->prev;
+                job->marked     = false;
+                mpay_subs_write(fd, job->i, &v[job->i]);
+                s.unknown++;
+            }
+        }
+        if (!active) {
+            if (paced) usleep(wait_ms*1000);
+            continue;
+        }
+        e = mpay_op_wait(_mpay, wait_ms, NULL);
+        if (!e/*err*/) goto cleanup_abort;
+        while ((op = mpay_op_next(_mpay))) {
+            struct mpay_subs_job *job    = mpay_op_get_data(op);
+            bool                  charge;
+            job->op = NULL;
+            charge  = mpay_subs_result(&v[job->i], job, op, &s, today);
+            mpay_op_destroy(op);
+            active--;
+            if (charge) {
+                /* Seldom, charge it now with its own sync. */
+                v[job->i].state = MPAY_SUBS_CHARGING;
+                if (mpay_subs_write(fd, job->i, &v[job->i]) && mpay_subs_sync(fd) &&
+                    mpay_subs_start(_mpay, &v[job->i], job, _ip)) {
+                    active++;
+                    continue;
+                }
+                v[job->i].state = job->prev;
+                s.unknown++;
+            }
+            mpay_subs_write(fd, job->i, &v[job->i]);
+        }
+    }
+    retval = mpay_subs_sync(fd);
+    goto cleanup;
+ cleanup_busy:
+    syslog(LOG_ERR, "Finish the operations of the handle first.");
+    return false;
+ cleanup_invalid_concurrency:
+    syslog(LOG_ERR, "Invalid concurrency.");
+    return false;
+ cleanup_invalid_ip:
+    syslog(LOG_ERR, "Missing the IP address to charge from.");
+    return false;
+ cleanup_errno:
+    syslog(LOG_ERR, "%s", strerror(errno));
+    goto cleanup;
+ cleanup_abort:
+    for (size_t j=0; j<jobs_sz; j++) {
+        if (jobs[j].op) {
+            /* Charges without answer are looked up by the next run. */
+            mpay_op_destroy(jobs[j].op);
+            s.unknown++;
+        } else if (j >= next && jobs[j].marked) {
+            v[jobs[j].i].state = jobs[j].prev;
+            mpay_subs_write(fd, jobs[j].i, &v[jobs[j].i]);
+        }
+    }
+    mpay_subs_sync(fd);
+    goto cleanup;
+ cleanup:
+    mpay_op_set_watch(_mpay, o_watch, o_timer, o_udata);
+    if (_opt_stats) *_opt_stats = s;
+    if (fd != -1) close(fd);
+    free(jobs);
+    free(link);
+    free(v);
+    return retval;
 }
 /**l*
  * 
@@ -6,9 +6,11 @@
 #include <time.h>
 #include <types/coin.h>
 
-typedef struct mpay   mpay;
-typedef struct json_t json_t;
+typedef struct mpay    mpay;
+typedef struct mpay_op mpay_op;
+typedef struct json_t  json_t;
 struct mpay_form;
+struct mpay_stats;
 
 enum mpay_method {
     MPAY_METHOD_INVALID = 0,
@@ -30,17 +32,89 @@ enum mpay_payment_state {
     MPAY_PAYMENT_UNFINISHED = 2,
     MPAY_PAYMENT_REFUNDED   = -1 /* Not part of REST, it marks it got a refund. */
 };
+enum mpay_op_events {
+    MPAY_OP_READ  = 1,
+    MPAY_OP_WRITE = 2
+};
+enum mpay_priority {
+    MPAY_PRIORITY_INTERACTIVE = 0, /* Checkout, a customer is waiting. */
+    MPAY_PRIORITY_BACKGROUND  = 1  /* Reconciliation, bulk checks, refreshes. */
+};
+enum mpay_error {
+    MPAY_ERROR_NONE    = 0,
+    MPAY_ERROR_NETWORK = 1, /* No response from PAYCOMET. */
+    MPAY_ERROR_SHED    = 2, /* Dropped by the scheduler, not sent. */
+    MPAY_ERROR_LIMIT   = 3  /* Over the adaptive concurrency limit, not sent. */
+};
+enum mpay_refund_status {
+    MPAY_REFUND_PENDING = 0,
+    MPAY_REFUND_DONE    = 1, /* Refunded. */
+    MPAY_REFUND_SKIPPED = 2, /* Already refunded, in the journal or PAYCOMET. */
+    MPAY_REFUND_FAILED  = 3, /* Not refunded, it can be retried. */
+    MPAY_REFUND_UNKNOWN = 4  /* No answer, the next run checks it. */
+};
+enum mpay_subs_state {
+    MPAY_SUBS_ACTIVE   = 0,
+    MPAY_SUBS_PAST_DUE = 1, /* The last charge was refused, retried later. */
+    MPAY_SUBS_CHARGING = 2, /* Sent without answer, looked up by the next run. */
+    MPAY_SUBS_CANCELED = 3, /* Canceled or out of retries. */
+    MPAY_SUBS_ENDED    = 4  /* Past its end date. */
+};
+enum mpay_trace_format {
+    MPAY_TRACE_CHROME = 0, /* Trace event format, chrome://tracing and Perfetto. */
+    MPAY_TRACE_OTLP   = 1  /* OTLP-JSON, one export request per line. */
+};
+enum mpay_transport {
+    MPAY_TRANSPORT_NETWORK      = 0,
+    MPAY_TRANSPORT_RECORD       = 1, /* Append every exchange to a file. */
+    MPAY_TRANSPORT_REPLAY       = 2, /* Serve recorded responses at full speed. */
+    MPAY_TRANSPORT_REPLAY_TIMED = 3  /* Serve recorded responses at recorded latency. */
+};
 
 
+/* PAYCOMET's base URL, it can be changed before creating handles. */
+extern const char *MPAY_URL;
 
 /* Constructor and destructor. */
-bool mpay_create  (mpay **_o);
-void mpay_destroy (mpay  *_o);
+bool mpay_create     (mpay **_o);
+bool mpay_create_env (mpay **_o);
+void mpay_destroy    (mpay  *_o);
 
 /* Setup authorization. */
 void mpay_set_auth (mpay  *_o, const char *_api_token, const char *_terminal);
 bool mpay_chk_auth (mpay  *_o, const char **_reason);
 
+/* Record/replay requests. */
+bool mpay_set_transport (mpay *_o, enum mpay_transport _transport, const char *_file);
+
+/* Pre-warm the connection and keep it open. */
+bool mpay_prewarm     (mpay *_o);
+bool mpay_keepalive   (mpay *_o, int _secs);
+void mpay_get_stats   (mpay *_o, struct mpay_stats *_s);
+void mpay_print_stats (mpay *_o, FILE *_fp);
+bool mpay_set_cache   (mpay *_o, const char *_file);
+
+/* Ask for compressed responses, "" all supported (default), NULL none. */
+bool mpay_set_compression (mpay *_o, const char *_encodings);
+
+/* Share in-flight payment info and exchange requests (default on). */
+void mpay_set_coalesce    (mpay *_o, bool _on);
+
+/* Priority classes and the process wide request scheduler. */
+struct mpay_sched_stats;
+void            mpay_set_priority      (mpay *_o, enum mpay_priority _priority);
+enum mpay_error mpay_last_error        (mpay *_o);
+void            mpay_sched_configure   (int _max_inflight, int _reserved, int _max_queued, int _max_wait_ms);
+void            mpay_sched_adaptive    (int _min_limit, int _max_limit, int _max_wait_ms);
+void            mpay_sched_get_stats   (struct mpay_sched_stats *_s);
+void            mpay_sched_print_stats (FILE *_fp);
+
+/* Trace spans of all handles to a file, a sample of the calls plus the
+ * failed ones and those slower than `_slow_ms` (0: Disabled). */
+bool mpay_trace_start (const char *_file, enum mpay_trace_format _format, double _sample, long _slow_ms);
+bool mpay_trace_flush (void);
+void mpay_trace_stop  (void);
+
 /* Check it works. */
 bool mpay_heartbeat    (mpay *_o, FILE *_fp1);
 
@@ -48,6 +122,18 @@ bool mpay_heartbeat    (mpay *_o, FILE *_fp1);
 bool mpay_form_prepare (struct mpay_form *_f, enum mpay_operationType type, char *opts[]);
 bool mpay_form         (mpay *_o, struct mpay_form *_form, char **_url_m);
 
+/* Charge a stored card token (idUser, tokenUser) without a form. */
+bool mpay_execute_purchase        (mpay                    *_o,
+                                   struct mpay_form        *_form,
+                                   enum mpay_payment_state *_opt_state,
+                                   char                   **_opt_url_m,
+                                   json_t                 **_opt_result);
+bool mpay_execute_purchase_rtoken (mpay                    *_o,
+                                   struct mpay_form        *_form,
+                                   enum mpay_payment_state *_opt_state,
+                                   char                   **_opt_url_m,
+                                   json_t                 **_opt_result);
+
 /* Auxiliary methods. */
 bool mpay_methods_get  (mpay *_o, json_t **_opt_r);
 bool mpay_exchange     (mpay *_o, coin_t _fr, coin_t *_to, const char *_currency);
@@ -64,7 +150,105 @@ bool mpay_payment_refund(mpay         *_o,
                          coin_t        _opt_different_amount,
                          json_t      **_opt_result);
 
+/* Refund many orders concurrently, with a journal to resume. */
+struct mpay_refund {
+    const char              *order;
+    coin_t                   amount; /* Partial amount, 0 cents: All. */
+    enum mpay_refund_status  status;
+};
+bool mpay_refund_many   (mpay               *_o,
+                         struct mpay_refund *_v,
+                         size_t              _vsz,
+                         int                 _concurrency,
+                         const char         *_journal);
+
+/* Recurring charges of stored cards, scheduled in a local index. */
+struct mpay_subs {
+    const char *id;          /* Up to 23 characters, no spaces. */
+    int         idUser;
+    const char *tokenUser;
+    coin_t      amount;
+    int         periodicity; /* Days between charges. */
+    time_t      start_date;  /* First charge, 0: Today. */
+    time_t      end_date;    /* 0: Never ends. */
+};
+struct mpay_subs_stats {
+    unsigned long due;
+    unsigned long charged;
+    unsigned long refused;   /* Retried later. */
+    unsigned long canceled;  /* Refused and out of retries. */
+    unsigned long unknown;   /* Not sent or no answer. */
+};
+bool mpay_subs_add    (const char *_index, struct mpay_subs *_v, size_t _vsz);
+bool mpay_subs_cancel (const char *_index, const char *_id);
+bool mpay_subs_list   (const char *_index, FILE *_fp);
+bool mpay_subs_run    (mpay                   *_o,
+                       const char             *_index,
+                       time_t                  _now,
+                       const char             *_ip,
+                       int                     _concurrency,
+                       double                  _rate,
+                       struct mpay_subs_stats *_opt_stats);
+
 
+/* Non-blocking operations. */
+typedef void (*mpay_op_watch_f) (void *_udata, int _fd, int _events); /* 0: Stop watching. */
+typedef void (*mpay_op_timer_f) (void *_udata, long _ms);             /* -1: Cancel timer.  */
+void     mpay_op_set_watch          (mpay *_o, mpay_op_watch_f _watch, mpay_op_timer_f _timer, void *_udata);
+bool     mpay_op_start_heartbeat    (mpay *_o, mpay_op **_op);
+bool     mpay_op_start_exchange     (mpay *_o, mpay_op **_op, coin_t _fr, const char *_currency);
+bool     mpay_op_start_form         (mpay *_o, mpay_op **_op, struct mpay_form *_form);
+bool     mpay_op_start_purchase     (mpay *_o, mpay_op **_op, struct mpay_form *_form);
+bool     mpay_op_start_payment_info (mpay *_o, mpay_op **_op, const char *_order);
+bool     mpay_op_start_refund       (mpay *_o, mpay_op **_op, const char *_order, json_t *_info, coin_t _opt_different_amount);
+bool     mpay_op_progress           (mpay *_o, int _fd, int _events, int *_opt_running);
+bool     mpay_op_wait               (mpay *_o, int _timeout_ms, int *_opt_running);
+mpay_op *mpay_op_next               (mpay *_o);
+bool     mpay_op_done               (mpay_op *_op);
+void     mpay_op_set_data           (mpay_op *_op, void *_data);
+void    *mpay_op_get_data           (mpay_op *_op);
+bool     mpay_op_result             (mpay_op *_op, json_t **_opt_r);
+long     mpay_op_rcode              (mpay_op *_op); /* HTTP status, 0: No response. */
+enum mpay_error mpay_op_error       (mpay_op *_op);
+bool     mpay_op_payment_info       (mpay_op *_op, enum mpay_payment_state *_opt_state, json_t **_opt_info, json_t **_opt_history);
+bool     mpay_op_url                (mpay_op *_op, enum mpay_payment_state *_opt_state, char **_opt_url_m);
+bool     mpay_op_exchange           (mpay_op *_op, coin_t *_to);
+void     mpay_op_destroy            (mpay_op *_op);
+
+
+struct mpay_stats {
+    unsigned long requests;     /* Requests sent to PAYCOMET. */
+    unsigned long warm;         /* Requests that found an open connection. */
+    unsigned long cold;         /* Requests that had to connect. */
+    unsigned long probes;       /* Pre-warm and keep-alive heartbeats. */
+    unsigned long probe_errors;
+    unsigned long coalesced;    /* Requests that shared another's response. */
+    unsigned long usec_dns;     /* Time resolving, connecting, in TLS */
+    unsigned long usec_connect; /* handshakes and total, summed up.   */
+    unsigned long usec_tls;
+    unsigned long usec_total;
+    unsigned long bytes_wire;   /* Response bodies as received. */
+    unsigned long bytes_body;   /* Response bodies once decoded. */
+};
+
+struct mpay_sched_stats {
+    int max_inflight;           /* 0: Unlimited. */
+    int reserved;               /* Slots only interactive requests can take. */
+    int limit;                  /* In effect now, adaptive or not. */
+    unsigned long usec_rtt;     /* Round trip time, recent and long term */
+    unsigned long usec_rtt_long;/* averages (adaptive limit only).       */
+    struct {
+        unsigned long inflight;
+        unsigned long queued;   /* Waiting for a slot now. */
+        unsigned long queued_max;
+        unsigned long admitted;
+        unsigned long delayed;  /* Admitted after waiting. */
+        unsigned long shed;
+        unsigned long limited;  /* Rejected over the adaptive limit. */
+        unsigned long usec_wait;
+        unsigned long usec_wait_max;
+    } prio[2];
+};
 
 struct escrow_target {
     const char *id;
@@ -83,6 +267,7 @@ struct mpay_form {
         coin_t                amount;
         int                   idUser;    /* User card id by paycomet, mandatory card payments. */
         const char           *tokenUser; /* User card id by paycomet, mandatory card payments. */
+        const char           *originalIp; /* Customer IP, mandatory in purchases. */
         int                   secure;
         const char           *scoring;   /* Risk skoring from 0 to 100. */
         int                   userInteraction; /* Business can interact with user? */